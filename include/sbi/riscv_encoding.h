@@ -166,6 +166,7 @@
 #define MSTATUS_SD			MSTATUS64_SD
 #define SSTATUS_SD			SSTATUS64_SD
 #define SATP_MODE			SATP64_MODE
+#define SATP_PPN			SATP64_PPN
 
 #define HGATP_PPN			HGATP64_PPN
 #define HGATP_VMID_SHIFT		HGATP64_VMID_SHIFT
@@ -175,6 +176,7 @@
 #define MSTATUS_SD			MSTATUS32_SD
 #define SSTATUS_SD			SSTATUS32_SD
 #define SATP_MODE			SATP32_MODE
+#define SATP_PPN			SATP32_PPN
 
 #define HGATP_PPN			HGATP32_PPN
 #define HGATP_VMID_SHIFT		HGATP32_VMID_SHIFT
@@ -394,6 +396,8 @@
 #define CSR_VSTVAL			0x243
 #define CSR_VSIP			0x244
 #define CSR_VSATP			0x280
+#define CSR_VSTIMECMP			0x24D
+#define CSR_VSTIMECMPH			0x25D
 
 /* Virtual Interrupts and Interrupt Priorities (H-extension with AIA) */
 #define CSR_HVIEN			0x608
@@ -830,6 +834,14 @@
 #define INSN_MASK_FENCE_TSO		0xffffffff
 #define INSN_MATCH_FENCE_TSO		0x8330000f
 
+#define INSN_MASK_CSRRW_SATP		0xfff0707f
+#define INSN_MATCH_CSRRW_SATP		((CSR_SATP << 20) | 0x1073)
+#define INSN_MASK_SFENCE_VMA		0xfe007fff
+#define INSN_MATCH_SFENCE_VMA		0x12000073
+#define INSN_MASK_HFENCE_GVMA		0xfe007fff
+#define INSN_MATCH_HFENCE_GVMA		0x62000073
+#define INSN_MATCH_SFENCE_W_INVAL	0x18000073
+
 // #define INSN_SRET 270532723
 #define INSN_SRET 0x10200073
 
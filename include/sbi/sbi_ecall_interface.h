@@ -41,11 +41,16 @@
 #define SBI_EXT_SM_MONITOR_INIT 0x3
 #define SBI_EXT_SM_REVERSE_MAP_INIT 0x4
 #define SBI_EXT_SM_PREPARE_MMIO 0x5
+#define SBI_EXT_SM_DESTROY_VM 0x6
+#define SBI_EXT_SM_REGISTER_MMIO 0x7
+#define SBI_EXT_SM_SET_RUN_PAGE 0x8
+#define SBI_EXT_SM_SET_GUEST_PRIVATE 0x9
 
 /* SBI sub-function IDs for SM_SET_PTE */
 #define SBI_EXT_SM_SET_PTE_CLEAR 0x0
 #define SBI_EXT_SM_SET_PTE_MEMCPY 0x1
 #define SBI_EXT_SM_SET_PTE_SET_ONE 0x2
+#define SBI_EXT_SM_SET_PTE_BATCH 0x3
 
 /* SBI function IDs for BASE extension*/
 #define SBI_EXT_BASE_GET_SPEC_VERSION		0x0
@@ -201,6 +206,18 @@ enum sbi_pmu_fw_event_code_id {
 	SBI_PMU_FW_MAX,
 };
 
+/**
+ * Firmware events specific to this implementation, in the range the SBI
+ * specification reserves for them (256 onwards).
+ */
+enum sbi_pmu_fw_impl_event_code_id {
+	SBI_PMU_FW_IMPL_BASE		= 256,
+	/* Remote fence requests queued / coalesced into a queued one */
+	SBI_PMU_FW_TLB_REQ_ENQUEUED	= SBI_PMU_FW_IMPL_BASE,
+	SBI_PMU_FW_TLB_REQ_MERGED	= 257,
+	SBI_PMU_FW_IMPL_MAX,
+};
+
 /** SBI PMU event idx type */
 enum sbi_pmu_event_type_id {
 	SBI_PMU_EVENT_TYPE_HW				= 0x0,
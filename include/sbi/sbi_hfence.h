@@ -36,4 +36,23 @@ void __sbi_hfence_vvma_va(unsigned long va);
 /** Invalidate all possible Stage2 TLBs */
 void __sbi_hfence_vvma_all(void);
 
+/* Svinval: invalidations between __sbi_sfence_w_inval/__sbi_sfence_inval_ir */
+
+void __sbi_sfence_w_inval(void);
+
+void __sbi_sfence_inval_ir(void);
+
+void __sbi_sinval_vma_asid_va(unsigned long va, unsigned long asid);
+
+void __sbi_sinval_vma_va(unsigned long va);
+
+void __sbi_hinval_gvma_vmid_gpa(unsigned long gpa_divby_4,
+				unsigned long vmid);
+
+void __sbi_hinval_gvma_gpa(unsigned long gpa_divby_4);
+
+void __sbi_hinval_vvma_asid_va(unsigned long va, unsigned long asid);
+
+void __sbi_hinval_vvma_va(unsigned long va);
+
 #endif
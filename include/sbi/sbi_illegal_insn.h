@@ -16,4 +16,6 @@ struct sbi_trap_regs;
 
 int sbi_illegal_insn_handler(ulong insn, struct sbi_trap_regs *regs);
 
+int sbi_illegal_insn_tvm_fast(ulong insn, struct sbi_trap_regs *regs);
+
 #endif
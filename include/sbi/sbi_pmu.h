@@ -30,7 +30,8 @@ struct sbi_pmu_device {
 
 	/**
 	 * Validate event code of custom firmware event
-	 * Note: SBI_PMU_FW_MAX <= event_idx_code
+	 * Note: SBI_PMU_FW_MAX <= event_idx_code, outside of the
+	 * SBI_PMU_FW_IMPL_BASE <= event_idx_code < SBI_PMU_FW_IMPL_MAX range
 	 */
 	int (*fw_event_validate_code)(uint32_t event_idx_code);
 
@@ -49,7 +50,8 @@ struct sbi_pmu_device {
 
 	/**
 	 * Start custom firmware counter
-	 * Note: SBI_PMU_FW_MAX <= event_idx_code
+	 * Note: SBI_PMU_FW_MAX <= event_idx_code, outside of the
+	 * SBI_PMU_FW_IMPL_BASE <= event_idx_code < SBI_PMU_FW_IMPL_MAX range
 	 * Note: 0 <= counter_index < SBI_PMU_FW_CTR_MAX
 	 */
 	int (*fw_counter_start)(uint32_t counter_index,
@@ -132,4 +134,6 @@ int sbi_pmu_ctr_cfg_match(unsigned long cidx_base, unsigned long cidx_mask,
 
 int sbi_pmu_ctr_incr_fw(enum sbi_pmu_fw_event_code_id fw_id);
 
+int sbi_pmu_ctr_incr_fw_impl(enum sbi_pmu_fw_impl_event_code_id fw_id);
+
 #endif
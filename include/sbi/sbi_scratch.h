@@ -48,17 +48,49 @@
 
 #include <sbi/sbi_types.h>
 #include <sbi/riscv_locks.h>
+#include <sbi/riscv_atomic.h>
+
+/*
+ * Ownership of a vCPU state, changed only by CAS. A running vCPU also
+ * records its HART above VCPU_STATUS_SHIFT.
+ */
+#define VCPU_IDLE		0
+#define VCPU_RUNNING		1
+#define VCPU_EXITING		2
+#define VCPU_STATUS_MASK	3
+#define VCPU_STATUS_SHIFT	2
+#define VCPU_RUNNING_ON(hartid) \
+	(((long)(hartid) << VCPU_STATUS_SHIFT) | VCPU_RUNNING)
 
 struct vcpu_state {
     struct sbi_trap_regs vcpu_state;
 	struct sbi_trap_info trap;
     bool was_csr_insn;
-	bool running;
 	bool next_mmio;
-	ulong prev_exception;
 	ulong hgatp;
 	ulong prev_mmio_insn;
-	spinlock_t lock;
+	/** VCPU_IDLE, VCPU_RUNNING_ON(hartid) or VCPU_EXITING */
+	atomic_t status;
+	/**
+	 * Physical address of the run page shared with the host, or 0. Bit 0
+	 * is set while the HART running the vCPU accesses the page.
+	 */
+	atomic_t run_page;
+	/** A VS-level software interrupt sent by the SM is not delivered yet */
+	unsigned long vssip_pending;
+	/** Key of the state in the vCPU registry */
+	unsigned long vm_id;
+	unsigned long cpu_id;
+} __cacheline_aligned;
+
+/** Delegation CSRs of the SM world switch, shadowed per HART */
+struct sm_world_switch {
+	/** mideleg/medeleg of the host, set up by delegate_traps */
+	unsigned long host_mideleg;
+	unsigned long host_medeleg;
+	/** mideleg/medeleg currently in the CSRs */
+	unsigned long mideleg;
+	unsigned long medeleg;
 };
 
 /** Representation of per-HART scratch space */
@@ -88,6 +120,10 @@ struct sbi_scratch {
 
 	unsigned long vm_id;
 	unsigned long cpu_id;
+	/** State of the vCPU last resumed on this HART */
+	struct vcpu_state *vcpu;
+	/** Shadow of the delegation CSRs */
+	struct sm_world_switch world_switch;
 };
 
 /**
@@ -65,6 +65,12 @@ typedef unsigned long		physical_size_t;
 #define __noreturn		__attribute__((noreturn))
 #define __aligned(x)		__attribute__((aligned(x)))
 
+/* Per-HART mutable data is padded to this to avoid false sharing */
+#define SBI_CACHELINE_SIZE	64
+#ifndef __cacheline_aligned
+#define __cacheline_aligned	__aligned(SBI_CACHELINE_SIZE)
+#endif
+
 #define likely(x) __builtin_expect((x), 1)
 #define unlikely(x) __builtin_expect((x), 0)
 
@@ -7,9 +7,12 @@
 #define DRAM_BASE 0x80000000 // TODO: get this value dynamically
 
 /**
- * Init the bitmap, set the bitmap memory as the secure memory
+ * Init the bitmap, set the bitmap memory as the secure memory.
+ * Each page takes 2 bits of metadata, so one byte of bitmap memory
+ * covers 4 pages (16KB) of DRAM. A small tail of the memory holds
+ * per-2MB and per-1GB private page counters.
  *
- * @param paddr_start The start address of the bitmap
+ * @param paddr_start The start address of the bitmap (8-byte aligned)
  * @param bitmap_memory_size The bitmap memory size
  * @return 0 on success, error code on failure
  */
@@ -4,11 +4,14 @@
 #include <sbi/sbi_types.h>
 
 /**
- * Init the reverse map, set the reverse map memory as the secure memory
+ * Init the reverse map, set the reverse map memory as the secure memory.
+ * Without CONFIG_SBI_ECALL_SM_REVERSE_MAP the memory only holds a small
+ * occupancy summary (leaf count and pfn bounds) per page of HPT Area.
  *
  * @param reverse_map_base The start address of the reverse map
  * @param reverse_map_size The reverse map memory size.
- * @param dummy_head_size The dummy head memory size.
+ * @param dummy_head_size The hash bucket memory size, the rest of the memory
+ *                        holds one node per leaf PTE
  * @return 0 on success, error code on failure
  */
 int init_reverse_map(uintptr_t reverse_map_base, uint64_t reverse_map_size,
@@ -44,6 +47,9 @@ int delete_reverse_map(uintptr_t pte, uintptr_t *pte_addr, uintptr_t page_num);
 
 /**
  * Invalidate all PTEs in HPT Area that point to the range of physical pages (not atomic).
+ * The host virtual ranges of the invalidated PTEs are collected on this hart
+ * until unmap_flush_batch is called, so that several calls share one TLB
+ * shootdown.
  * @param pfn_start The start page frame
  * @param num The number of pages in the pfn range
  * @return 0 on success, negative error code on failure
@@ -51,6 +57,15 @@ int delete_reverse_map(uintptr_t pte, uintptr_t *pte_addr, uintptr_t page_num);
  */
 int unmap_range(uint64_t pfn_start, uint64_t num);
 
+/**
+ * Flush the TLBs of all harts for the host virtual ranges collected by
+ * unmap_range on this hart. The ranges are coalesced into one remote
+ * sfence.vma, upgraded to a full flush past the platform flush limit.
+ * @return 0 on success, negative error code on failure
+ * @note Call this after unlock_bitmap, remote harts may be waiting for it
+ */
+int unmap_flush_batch(void);
+
 /**
  * @brief Set the PTE
  *
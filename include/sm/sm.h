@@ -32,7 +32,11 @@ int bitmap_and_hpt_init(uintptr_t bitmap_start, uint64_t bitmap_size,
  * 2. Set up the PMP.
  *
  * @param reverse_map_start The start address of the reverse map
- * @param reverse_map_size The reverse map memory size.
+ * @param reverse_map_size The reverse map memory size. Two HPT Area sizes
+ *                         are used for the index, the rest for the nodes.
+ *                         16 more bytes per page of HPT Area track the
+ *                         page-table links. Without the reverse map, 40
+ *                         bytes per page of HPT Area are needed.
  * @return 0 on success, negative error code on failure
  */
 int sm_reverse_map_init(uintptr_t reverse_map_start, uint64_t reverse_map_size);
@@ -55,6 +59,35 @@ int monitor_init(uintptr_t *mstatus);
  */
 int sm_set_bounce_buffer(uintptr_t gpaddr_start, uint64_t size);
 
+/**
+ * Set a memory region of the calling guest as private. The mappings of
+ * the region in HPT Area are invalidated, with one TLB shootdown for the
+ * whole region. The whole region is checked first: when it is not mapped,
+ * not in the bitmap or contains SM memory, nothing is converted.
+ *
+ * @param gpaddr_start guest physical address of the start of the region
+ * @param size size of the region
+ * @return 0 on success, negative error code on failure
+ */
+int sm_set_private_memory(uintptr_t gpaddr_start, uint64_t size);
+
+/**
+ * Drop the cached G-stage translations of the current hart, called when
+ * the host executes hfence.gvma / hinval.gvma
+ *
+ * @param vmid the VMID whose translations are dropped
+ * @param all drop the translations of every VMID
+ */
+void sm_gpa_cache_flush(unsigned long vmid, bool all);
+
+/**
+ * Drop the cached G-stage translations of the VMID in hgatp that were
+ * made under another root, called when the host writes hgatp
+ *
+ * @param hgatp the new value of hgatp
+ */
+void sm_gpa_cache_set_hgatp(unsigned long hgatp);
+
 /**
  * Saves CPU details into global memory
  *
@@ -66,6 +99,17 @@ int sm_preserve_cpu(struct sbi_trap_regs *regs, struct sbi_trap_info *trap);
 
 int sm_prepare_mmio(uint64_t cpu_id);
 
+/**
+ * Declare a MMIO region of the calling guest. Guest page faults inside
+ * it are passed to the host as MMIO in a single exit, without
+ * sm_prepare_mmio. A VM has at most 8 regions, which may not overlap.
+ *
+ * @param gpa guest physical address of the start of the region
+ * @param size size of the region
+ * @return 0 on success, negative error code on failure
+ */
+int sm_register_mmio(uintptr_t gpa, uint64_t size);
+
 /**
  * Create a CPU (TODO: Details)
  *
@@ -74,6 +118,63 @@ int sm_prepare_mmio(uint64_t cpu_id);
  */
 int sm_create_cpu(uint64_t cpu_id, const struct sbi_trap_regs *regs);
 
+/**
+ * Release the vCPU states of a VM, none of its vCPUs may be running
+ *
+ * @param vm_id VMID of the VM
+ * @return 0 on success, negative error code on failure
+ */
+int sm_destroy_vm(unsigned long vm_id);
+
+/**
+ * Exit record of a vCPU in a page of host memory, written by the SM when
+ * the vCPU exits and read back on SBI_EXT_SM_RESUME
+ */
+struct sm_run_page {
+	/** exit cause, as in scause */
+	unsigned long cause;
+	/** trap value, as in stval */
+	unsigned long tval;
+	/** guest physical address of a guest page fault */
+	unsigned long gpa;
+	/** the trapped MMIO or CSR instruction, MMIO in the htinst format */
+	unsigned long insn;
+	/** size in bytes of a MMIO access, 0 if the exit is not MMIO */
+	unsigned long access_size;
+	/** data of a MMIO store, value written by a CSR instruction */
+	unsigned long data;
+	/** a0-a7 of an ecall */
+	unsigned long gprs[8];
+	/** set by the host: data of a MMIO load, value read by a CSR instruction */
+	unsigned long ret_value;
+	/** set by the host: a0-a7 returned from an ecall */
+	unsigned long ret_gprs[8];
+};
+
+/**
+ * Register the run page of a vCPU of the VM in hgatp. The page must be
+ * public and stays in use until it is replaced, unregistered with 0 or
+ * made private by sm_set_private_memory. Once registered, the responses
+ * of the host are taken from the run page instead of stval/scause and
+ * a0-a7.
+ *
+ * @param cpu_id id of the vCPU
+ * @param addr page aligned physical address of the run page, 0 to
+ *             unregister
+ * @return 0 on success, negative error code on failure
+ */
+int sm_set_run_page(uint64_t cpu_id, uintptr_t addr);
+
+/**
+ * Handle a SBI call of the running confidential guest in the SM, without
+ * a world switch to the host: set_timer with Sstc, send_ipi to running
+ * vCPUs of the same VM
+ *
+ * @param regs the trap frame of the guest
+ * @return 0 if the call was completed, otherwise it goes to the host
+ */
+int sm_guest_ecall(struct sbi_trap_regs *regs);
+
 /**
  * Resume a CPU (TODO: Details)
  *
@@ -90,16 +191,38 @@ int sm_resume_cpu(uint64_t cpu_id, struct sbi_trap_regs *regs);
  */
 int get_page_num(uintptr_t pte_addr);
 
+/** One entry of a SBI_EXT_SM_SET_PTE_BATCH request */
+struct sm_pte_update {
+	/** physical address of the entry */
+	unsigned long addr;
+	/** the new value of the entry */
+	unsigned long pte;
+};
+
+/** Maximum number of entries of a SBI_EXT_SM_SET_PTE_BATCH request */
+#define SM_PTE_BATCH_MAX 64
+
 /**
  * Set pte entry, check if the action is valid
  *
+ * For SBI_EXT_SM_SET_PTE_BATCH, addr points to an array of at most
+ * SM_PTE_BATCH_MAX struct sm_pte_update, aligned and outside the SM
+ * regions. It is copied, and the whole copy is validated before any entry
+ * is written, all under one bitmap_lock acquisition. A rejected entry
+ * leaves every entry unwritten.
+ *
  * @param sub_fid sub-function id, SBI_EXT_SM_SET_PTE_*
  * @param addr physical address of the entry / destination physical address
+ *             / the array of updates
  * @param pte_or_src the new value of the entry / source physical address
- * @param size the size of the entries
+ * @param size the size of the entries / the size of the array in bytes
+ * @param failed SBI_EXT_SM_SET_PTE_BATCH: the index of the first failing
+ *               entry, the number of entries if none fails
+ * @param applied SBI_EXT_SM_SET_PTE_BATCH: the number of entries written
  * @return 0 on success, negative error code on failure
  */
 int sm_set_pte(unsigned long sub_fid, unsigned long *addr,
-	       unsigned long pte_or_src, size_t size);
+	       unsigned long pte_or_src, size_t size, unsigned long *failed,
+	       unsigned long *applied);
 
 #endif
@@ -30,8 +30,9 @@ static int sbi_ecall_sm_handler(unsigned long extid, unsigned long funcid,
 					  regs->a3, regs->a4, regs->a5);
 		break;
 	case SBI_EXT_SM_SET_PTE:
+		// SBI_EXT_SM_SET_PTE_BATCH: failing index in a1, count in a2
 		ret = sm_set_pte(regs->a0, (unsigned long *)regs->a1, regs->a2,
-				 regs->a3);
+				 regs->a3, out_val, &regs->a2);
 		break;
 	case SBI_EXT_SM_MONITOR_INIT:
 		ret = monitor_init(&regs->mstatus);
@@ -42,6 +43,50 @@ static int sbi_ecall_sm_handler(unsigned long extid, unsigned long funcid,
 	case SBI_EXT_SM_PREPARE_MMIO:
 		ret = sm_prepare_mmio(regs->a0);
 		break;
+	case SBI_EXT_SM_DESTROY_VM:
+#if __riscv_xlen == 32
+		if (unlikely(regs->mstatusH & MSTATUSH_MPV)) {
+#else
+		if (unlikely(regs->mstatus & MSTATUS_MPV)) {
+#endif
+			ret = -1;
+		} else {
+			ret = sm_destroy_vm(regs->a0);
+		}
+		break;
+	case SBI_EXT_SM_REGISTER_MMIO:
+#if __riscv_xlen == 32
+		if (unlikely(!(regs->mstatusH & MSTATUSH_MPV))) {
+#else
+		if (unlikely(!(regs->mstatus & MSTATUS_MPV))) {
+#endif
+			ret = -1;
+		} else {
+			ret = sm_register_mmio(regs->a0, regs->a1);
+		}
+		break;
+	case SBI_EXT_SM_SET_GUEST_PRIVATE:
+#if __riscv_xlen == 32
+		if (unlikely(!(regs->mstatusH & MSTATUSH_MPV))) {
+#else
+		if (unlikely(!(regs->mstatus & MSTATUS_MPV))) {
+#endif
+			ret = -1;
+		} else {
+			ret = sm_set_private_memory(regs->a0, regs->a1);
+		}
+		break;
+	case SBI_EXT_SM_SET_RUN_PAGE:
+#if __riscv_xlen == 32
+		if (unlikely(regs->mstatusH & MSTATUSH_MPV)) {
+#else
+		if (unlikely(regs->mstatus & MSTATUS_MPV)) {
+#endif
+			ret = -1;
+		} else {
+			ret = sm_set_run_page(regs->a0, regs->a1);
+		}
+		break;
 	default:
 		sbi_printf(
 			"SBI_ENOTSUPP: extid 0x%lx, funcid 0x%lx, a0 0x%lx, a1 0x%lx, a2 0x%lx, a3 0x%lx, a4 0x%lx, a5 0x%lx\n",
@@ -233,6 +233,11 @@ static int delegate_traps(struct sbi_scratch *scratch)
 	csr_write(CSR_MIDELEG, interrupts);
 	csr_write(CSR_MEDELEG, exceptions);
 
+	scratch->world_switch.host_mideleg = interrupts;
+	scratch->world_switch.host_medeleg = exceptions;
+	scratch->world_switch.mideleg	   = interrupts;
+	scratch->world_switch.medeleg	   = exceptions;
+
 	return 0;
 }
 
@@ -433,6 +438,9 @@ static inline char *sbi_hart_extension_id2string(int ext)
 	case SBI_HART_EXT_SMSTATEEN:
 		estr = "smstateen";
 		break;
+	case SBI_HART_EXT_SVINVAL:
+		estr = "svinval";
+		break;
 	default:
 		break;
 	}
@@ -680,6 +688,12 @@ __mhpm_skip:
 					SBI_HART_EXT_SMSTATEEN, true);
 	}
 
+	/* Detect if hart supports Svinval, it has no CSR to probe */
+	insn_exec_allowed(INSN_MATCH_SFENCE_W_INVAL, (unsigned long)&trap);
+	if (!trap.cause)
+		__sbi_hart_update_extension(hfeatures,
+					SBI_HART_EXT_SVINVAL, true);
+
 	/* Let platform populate extensions */
 	rc = sbi_platform_extensions_init(sbi_platform_thishart_ptr(),
 					  hfeatures);
@@ -29,6 +29,19 @@
 static const struct sbi_hsm_device *hsm_dev = NULL;
 static unsigned long hart_data_offset;
 
+/* HARTs in STARTED or SUSPENDED state, i.e. the ones that take IPIs */
+static struct sbi_hartmask hsm_interruptible_harts;
+
+static inline void hsm_set_interruptible(u32 hartid, bool interruptible)
+{
+	if (interruptible)
+		atomic_raw_set_bit(hartid,
+				   sbi_hartmask_bits(&hsm_interruptible_harts));
+	else
+		atomic_raw_clear_bit(hartid,
+				     sbi_hartmask_bits(&hsm_interruptible_harts));
+}
+
 /** Per hart specific data to manage state transition **/
 struct sbi_hsm_data {
 	atomic_t state;
@@ -69,27 +82,24 @@ int sbi_hsm_hart_get_state(const struct sbi_domain *dom, u32 hartid)
 int sbi_hsm_hart_interruptible_mask(const struct sbi_domain *dom,
 				    ulong hbase, ulong *out_hmask)
 {
-	int hstate;
-	ulong i, hmask, dmask;
+	ulong hmask, bword, boff;
 	ulong hend = sbi_scratch_last_hartid() + 1;
 
 	*out_hmask = 0;
 	if (hend <= hbase)
 		return SBI_EINVAL;
-	if (BITS_PER_LONG < (hend - hbase))
-		hend = hbase + BITS_PER_LONG;
-
-	dmask = sbi_domain_get_assigned_hartmask(dom, hbase);
-	for (i = hbase; i < hend; i++) {
-		hmask = 1UL << (i - hbase);
-		if (dmask & hmask) {
-			hstate = __sbi_hsm_hart_get_state(i);
-			if (hstate == SBI_HSM_STATE_STARTED ||
-			    hstate == SBI_HSM_STATE_SUSPENDED)
-				*out_hmask |= hmask;
-		}
+
+	/* Taken from the cached mask, kept up to date on state changes */
+	bword = BIT_WORD(hbase);
+	boff  = BIT_WORD_OFFSET(hbase);
+	hmask = sbi_hartmask_bits(&hsm_interruptible_harts)[bword++] >> boff;
+	if (boff && bword < BIT_WORD(SBI_HARTMASK_MAX_BITS)) {
+		hmask |= (sbi_hartmask_bits(&hsm_interruptible_harts)[bword] &
+			  (BIT(boff) - 1UL)) << (BITS_PER_LONG - boff);
 	}
 
+	*out_hmask = hmask & sbi_domain_get_assigned_hartmask(dom, hbase);
+
 	return 0;
 }
 
@@ -103,6 +113,7 @@ void sbi_hsm_prepare_next_jump(struct sbi_scratch *scratch, u32 hartid)
 				  SBI_HSM_STATE_STARTED);
 	if (oldstate != SBI_HSM_STATE_START_PENDING)
 		sbi_hart_hang();
+	hsm_set_interruptible(hartid, TRUE);
 }
 
 static void sbi_hsm_hart_wait(struct sbi_scratch *scratch, u32 hartid)
@@ -314,6 +325,7 @@ int sbi_hsm_hart_stop(struct sbi_scratch *scratch, bool exitnow)
 			   __func__, oldstate);
 		return SBI_EFAIL;
 	}
+	hsm_set_interruptible(current_hartid(), FALSE);
 
 	if (exitnow)
 		sbi_exit(scratch);
@@ -375,6 +387,7 @@ void sbi_hsm_hart_resume_start(struct sbi_scratch *scratch)
 			   __func__, oldstate);
 		sbi_hart_hang();
 	}
+	hsm_set_interruptible(current_hartid(), FALSE);
 
 	hsm_device_hart_resume();
 }
@@ -393,6 +406,7 @@ void sbi_hsm_hart_resume_finish(struct sbi_scratch *scratch)
 			   __func__, oldstate);
 		sbi_hart_hang();
 	}
+	hsm_set_interruptible(current_hartid(), TRUE);
 
 	/*
 	 * Restore some of the M-mode CSRs which we are re-configured by
@@ -13,6 +13,7 @@
 #include <sbi/sbi_bitops.h>
 #include <sbi/sbi_emulate_csr.h>
 #include <sbi/sbi_error.h>
+#include <sbi/sbi_hfence.h>
 #include <sbi/sbi_illegal_insn.h>
 #include <sbi/sbi_pmu.h>
 #include <sbi/sbi_trap.h>
@@ -147,6 +148,95 @@ static void execute_instruction(const ulong insn) {
 	func();
 }
 
+/*
+ * A host satp value: Bare with no root, or a root in the PGD section of
+ * the HPT Area
+ */
+static inline bool tvm_satp_valid(ulong satp)
+{
+	ulong root = (satp & SATP_PPN) << PAGE_SHIFT;
+
+	if (!(satp & SATP_MODE))
+		return !root;
+#if __riscv_xlen == 64
+	return ((satp & SATP_MODE) >> 60) == SATP_MODE_SV39 &&
+	       get_page_num(root) == 512 * 512;
+#else
+	return FALSE;
+#endif
+}
+
+/*
+ * Fast path for the TVM traps the host takes all the time: satp writes
+ * on every context switch, sfence.vma and hfence.gvma. It is called at
+ * the top of the trap handler with mtval, so only the common forms are
+ * handled here; anything else returns SBI_ENOTSUPP and goes through
+ * sbi_illegal_insn_handler.
+ */
+int sbi_illegal_insn_tvm_fast(ulong insn, struct sbi_trap_regs *regs)
+{
+	ulong rs1, rs2;
+
+	// only the host kernel: HS mode, not its user space nor a guest
+#if __riscv_xlen == 32
+	if (regs->mstatusH & MSTATUSH_MPV)
+#else
+	if (regs->mstatus & MSTATUS_MPV)
+#endif
+		return SBI_ENOTSUPP;
+	if (((regs->mstatus & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT) != PRV_S)
+		return SBI_ENOTSUPP;
+
+	if ((insn & INSN_MASK_CSRRW_SATP) == INSN_MATCH_CSRRW_SATP) {
+		rs1 = GET_RS1(insn, regs);
+		if (!tvm_satp_valid(rs1))
+			return SBI_ENOTSUPP;
+		SET_RD(insn, regs, csr_swap(CSR_SATP, rs1));
+	} else if ((insn & INSN_MASK_SFENCE_VMA) == INSN_MATCH_SFENCE_VMA) {
+		// x0 in rs1/rs2 means all addresses/ASIDs
+		rs1 = GET_RS1(insn, regs);
+		rs2 = GET_RS2(insn, regs);
+		if (!(insn & (0x1f << SH_RS1)) && !(insn & (0x1f << SH_RS2)))
+			__asm__ __volatile__("sfence.vma" : : : "memory");
+		else if (!(insn & (0x1f << SH_RS2)))
+			__asm__ __volatile__("sfence.vma %0"
+					     :
+					     : "r"(rs1)
+					     : "memory");
+		else if (!(insn & (0x1f << SH_RS1)))
+			__asm__ __volatile__("sfence.vma x0, %0"
+					     :
+					     : "r"(rs2)
+					     : "memory");
+		else
+			__asm__ __volatile__("sfence.vma %0, %1"
+					     :
+					     : "r"(rs1), "r"(rs2)
+					     : "memory");
+	} else if ((insn & INSN_MASK_HFENCE_GVMA) == INSN_MATCH_HFENCE_GVMA) {
+		rs1 = GET_RS1(insn, regs);
+		rs2 = GET_RS2(insn, regs);
+		if (!(insn & (0x1f << SH_RS2))) {
+			sm_gpa_cache_flush(0, true);
+			if (!(insn & (0x1f << SH_RS1)))
+				__sbi_hfence_gvma_all();
+			else
+				__sbi_hfence_gvma_gpa(rs1);
+		} else {
+			sm_gpa_cache_flush(rs2, false);
+			if (!(insn & (0x1f << SH_RS1)))
+				__sbi_hfence_gvma_vmid(rs2);
+			else
+				__sbi_hfence_gvma_vmid_gpa(rs1, rs2);
+		}
+	} else {
+		return SBI_ENOTSUPP;
+	}
+
+	regs->mepc += 4;
+	return 0;
+}
+
 int sbi_illegal_insn_handler(ulong insn, struct sbi_trap_regs *regs)
 {
 	struct sbi_trap_info uptrap;
@@ -182,11 +272,13 @@ int sbi_illegal_insn_handler(ulong insn, struct sbi_trap_regs *regs)
 					     : "=r"(__tmp)
 					     : "rK"(val)
 					     : "memory");
-			else
+			else {
 				asm volatile("csrrw %0, hgatp, %1"
 					     : "=r"(__tmp)
 					     : "rK"(val)
 					     : "memory");
+				sm_gpa_cache_set_hgatp(val);
+			}
 			((unsigned long *)regs)[idx] = __tmp;
 			regs->mepc += 4;
 			return 0;
@@ -213,11 +305,13 @@ int sbi_illegal_insn_handler(ulong insn, struct sbi_trap_regs *regs)
 					     : "=r"(__tmp)
 					     : "rK"(val)
 					     : "memory");
-			else
+			else {
 				asm volatile("csrrw %0, hgatp, %1"
 					     : "=r"(__tmp)
 					     : "rK"(val)
 					     : "memory");
+				sm_gpa_cache_set_hgatp(val);
+			}
 			((unsigned long *)regs)[idx] = __tmp;
 			regs->mepc += 4;
 			return 0;
@@ -260,6 +354,9 @@ int sbi_illegal_insn_handler(ulong insn, struct sbi_trap_regs *regs)
 	/* Case 5: hfence.gvma trapped by TVM */
 	if (((insn & 0x7fff) == 0b1110011) &&
 	    (((insn >> 25) & 0x7f) == 0b0110001)) {
+		int rs2 = (insn >> 20) & 0x1f;
+		sm_gpa_cache_flush(rs2 ? *((unsigned long *)regs + rs2) : 0,
+				   !rs2);
 		execute_instruction(insn);
 		regs->mepc += 4;
 		return 0;
@@ -267,6 +364,9 @@ int sbi_illegal_insn_handler(ulong insn, struct sbi_trap_regs *regs)
 	/* Case 6: hinval.gvma trapped by TVM */
 	if (((insn & 0x7fff) == 0b1110011) &&
 	    (((insn >> 25) & 0x7f) == 0b0110011)) {
+		int rs2 = (insn >> 20) & 0x1f;
+		sm_gpa_cache_flush(rs2 ? *((unsigned long *)regs + rs2) : 0,
+				   !rs2);
 		execute_instruction(insn);
 		regs->mepc += 4;
 		return 0;
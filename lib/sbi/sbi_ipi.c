@@ -31,18 +31,18 @@ static unsigned long ipi_data_off;
 static const struct sbi_ipi_device *ipi_dev = NULL;
 static const struct sbi_ipi_event_ops *ipi_ops_array[SBI_IPI_EVENT_MAX];
 
+/*
+ * Post the payload of an event to a remote HART and raise its IPI. The
+ * sender waits for the completions of all targets at once, in
+ * sbi_ipi_send_many.
+ */
 static int sbi_ipi_send(struct sbi_scratch *scratch, u32 remote_hartid,
 			u32 event, void *data)
 {
 	int ret;
 	struct sbi_scratch *remote_scratch = NULL;
 	struct sbi_ipi_data *ipi_data;
-	const struct sbi_ipi_event_ops *ipi_ops;
-
-	if ((SBI_IPI_EVENT_MAX <= event) ||
-	    !ipi_ops_array[event])
-		return SBI_EINVAL;
-	ipi_ops = ipi_ops_array[event];
+	const struct sbi_ipi_event_ops *ipi_ops = ipi_ops_array[event];
 
 	remote_scratch = sbi_hartid_to_scratch(remote_hartid);
 	if (!remote_scratch)
@@ -69,9 +69,6 @@ static int sbi_ipi_send(struct sbi_scratch *scratch, u32 remote_hartid,
 
 	sbi_pmu_ctr_incr_fw(SBI_PMU_FW_IPI_SENT);
 
-	if (ipi_ops->sync)
-		ipi_ops->sync(scratch);
-
 	return 0;
 }
 
@@ -86,6 +83,12 @@ int sbi_ipi_send_many(ulong hmask, ulong hbase, u32 event, void *data)
 	ulong i, m;
 	struct sbi_domain *dom = sbi_domain_thishart_ptr();
 	struct sbi_scratch *scratch = sbi_scratch_thishart_ptr();
+	const struct sbi_ipi_event_ops *ipi_ops;
+
+	if ((SBI_IPI_EVENT_MAX <= event) ||
+	    !ipi_ops_array[event])
+		return SBI_EINVAL;
+	ipi_ops = ipi_ops_array[event];
 
 	if (hbase != -1UL) {
 		rc = sbi_hsm_hart_interruptible_mask(dom, hbase, &m);
@@ -110,6 +113,10 @@ int sbi_ipi_send_many(ulong hmask, ulong hbase, u32 event, void *data)
 		}
 	}
 
+	/* Wait for the targets, which handle the IPIs in parallel */
+	if (ipi_ops->sync)
+		ipi_ops->sync(scratch);
+
 	return 0;
 }
 
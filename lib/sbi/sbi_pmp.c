@@ -24,7 +24,7 @@ static void sbi_process_pmp(struct sbi_scratch *scratch)
 	struct pmp_config_t pmp_config = *(struct pmp_config_t *)(data);
 	struct sbi_scratch *rscratch   = NULL;
 	u32 rhartid;
-	unsigned long *pmp_sync = NULL;
+	atomic_t *pmp_sync = NULL;
 	pmp_set(pmp_config.n, pmp_config.prot, pmp_config.addr,
 		pmp_config.log2len);
 
@@ -35,8 +35,7 @@ static void sbi_process_pmp(struct sbi_scratch *scratch)
 		if (!rscratch)
 			continue;
 		pmp_sync = sbi_scratch_offset_ptr(rscratch, pmp_sync_offset);
-		while (atomic_raw_xchg_ulong(pmp_sync, 1))
-			;
+		atomic_sub_return(pmp_sync, 1);
 	}
 }
 
@@ -58,16 +57,18 @@ static int sbi_update_pmp(struct sbi_scratch *scratch,
 	pmp_data = sbi_scratch_offset_ptr(remote_scratch, pmp_data_offset);
 	// update the remote hart pmp data
 	sbi_memcpy(pmp_data, data, sizeof(struct pmp_data_t));
+	// the remote hart completes it in sbi_process_pmp
+	atomic_add_return(sbi_scratch_offset_ptr(scratch, pmp_sync_offset), 1);
 
 	return 0;
 }
 
 static void sbi_pmp_sync(struct sbi_scratch *scratch)
 {
-	unsigned long *pmp_sync =
+	atomic_t *pmp_sync =
 		sbi_scratch_offset_ptr(scratch, pmp_sync_offset);
-	// wait the remote hart process the pmp signal
-	while (!atomic_raw_xchg_ulong(pmp_sync, 0))
+	// wait for all the remote harts to process the pmp signal
+	while (atomic_read(pmp_sync) > 0)
 		;
 	return;
 }
@@ -90,7 +91,7 @@ int sbi_pmp_init(struct sbi_scratch *scratch, bool cold_boot)
 {
 	int ret;
 	struct pmp_data_t *pmpdata;
-	unsigned long *pmp_sync;
+	atomic_t *pmp_sync;
 
 	if (cold_boot) {
 		// Define the pmp data offset in the scratch
@@ -106,7 +107,7 @@ int sbi_pmp_init(struct sbi_scratch *scratch, bool cold_boot)
 
 		pmp_sync = sbi_scratch_offset_ptr(scratch, pmp_sync_offset);
 
-		*pmp_sync = 0;
+		ATOMIC_INIT(pmp_sync, 0);
 
 		ret = sbi_ipi_event_create(&pmp_ops);
 		if (ret < 0) {
@@ -135,7 +136,9 @@ int set_pmp_and_sync(unsigned int n, unsigned long prot, unsigned long addr,
         pmp_data.pmp_config_arg.prot = prot;
         pmp_data.pmp_config_arg.addr = addr;
         pmp_data.pmp_config_arg.log2len = log2len;
-	SBI_HARTMASK_INIT_EXCEPT(&(pmp_data.smask), source_hart);
+	// only this hart waits for the completions
+	SBI_HARTMASK_INIT(&(pmp_data.smask));
+	sbi_hartmask_set_hart(source_hart, &(pmp_data.smask));
 	sbi_send_pmp(0xFFFFFFFF & (~(1 << source_hart)), 0, &pmp_data);
 	return 0;
 }
@@ -56,17 +56,21 @@ static const struct sbi_pmu_device *pmu_dev = NULL;
 /* Mapping between event range and possible counters  */
 static struct sbi_pmu_hw_event hw_event_map[SBI_PMU_HW_EVENT_MAX] = {0};
 
-/* counter to enabled event mapping */
-static uint32_t active_events[SBI_HARTMASK_MAX_BITS][SBI_PMU_HW_CTR_MAX + SBI_PMU_FW_CTR_MAX];
-
-/* Bitmap of firmware counters started on each HART */
 #if SBI_PMU_FW_CTR_MAX >= BITS_PER_LONG
 #error "Can't handle firmware counters beyond BITS_PER_LONG"
 #endif
-static unsigned long fw_counters_started[SBI_HARTMASK_MAX_BITS];
 
-/* Values of firmwares counters on each HART */
-static uint64_t fw_counters_value[SBI_HARTMASK_MAX_BITS][SBI_PMU_FW_CTR_MAX] = {0};
+/* Counter state of a HART, on its own cache lines */
+struct sbi_pmu_hart_state {
+	/* counter to enabled event mapping */
+	uint32_t active_events[SBI_PMU_HW_CTR_MAX + SBI_PMU_FW_CTR_MAX];
+	/* Bitmap of firmware counters started */
+	unsigned long fw_counters_started;
+	/* Values of firmwares counters */
+	uint64_t fw_counters_value[SBI_PMU_FW_CTR_MAX];
+} __cacheline_aligned;
+
+static struct sbi_pmu_hart_state pmu_hart_state[SBI_HARTMASK_MAX_BITS];
 
 /* Maximum number of hardware events available */
 static uint32_t num_hw_events;
@@ -80,6 +84,14 @@ static uint32_t total_ctrs;
 #define get_cidx_type(x) ((x & SBI_PMU_EVENT_IDX_TYPE_MASK) >> 16)
 #define get_cidx_code(x) (x & SBI_PMU_EVENT_IDX_CODE_MASK)
 
+/* Firmware events of this implementation, counted like the standard ones */
+#define pmu_fw_event_is_impl(code) \
+	(SBI_PMU_FW_IMPL_BASE <= (code) && (code) < SBI_PMU_FW_IMPL_MAX)
+
+/* Firmware events counted by the platform PMU device */
+#define pmu_fw_event_is_dev(code) \
+	(SBI_PMU_FW_MAX <= (code) && !pmu_fw_event_is_impl(code) && pmu_dev)
+
 /**
  * Perform a sanity check on event & counter mappings with event range overlap check
  * @param evtA Pointer to the existing hw event structure
@@ -118,8 +130,10 @@ static int pmu_event_validate(unsigned long event_idx)
 		event_idx_code_max = SBI_PMU_HW_GENERAL_MAX;
 		break;
 	case SBI_PMU_EVENT_TYPE_FW:
-		if (SBI_PMU_FW_MAX <= event_idx_code &&
-		    pmu_dev && pmu_dev->fw_event_validate_code)
+		if (pmu_fw_event_is_impl(event_idx_code))
+			return event_idx_type;
+		if (pmu_fw_event_is_dev(event_idx_code) &&
+		    pmu_dev->fw_event_validate_code)
 			return pmu_dev->fw_event_validate_code(event_idx_code);
 		else
 			event_idx_code_max = SBI_PMU_FW_MAX;
@@ -162,7 +176,7 @@ static int pmu_ctr_validate(uint32_t cidx, uint32_t *event_idx_code)
 	if (cidx >= total_ctrs)
 		return SBI_EINVAL;
 
-	event_idx_val = active_events[hartid][cidx];
+	event_idx_val = pmu_hart_state[hartid].active_events[cidx];
 	event_idx_type = get_cidx_type(event_idx_val);
 	if (event_idx_val == SBI_PMU_EVENT_IDX_INVALID ||
 	    event_idx_type >= SBI_PMU_EVENT_TYPE_MAX)
@@ -183,12 +197,12 @@ int sbi_pmu_ctr_fw_read(uint32_t cidx, uint64_t *cval)
 	if (event_idx_type != SBI_PMU_EVENT_TYPE_FW)
 		return SBI_EINVAL;
 
-	if (SBI_PMU_FW_MAX <= event_code &&
-	    pmu_dev && pmu_dev->fw_counter_read_value)
-		fw_counters_value[hartid][cidx - num_hw_ctrs] =
+	if (pmu_fw_event_is_dev(event_code) &&
+	    pmu_dev->fw_counter_read_value)
+		pmu_hart_state[hartid].fw_counters_value[cidx - num_hw_ctrs] =
 			pmu_dev->fw_counter_read_value(cidx - num_hw_ctrs);
 
-	*cval = fw_counters_value[hartid][cidx - num_hw_ctrs];
+	*cval = pmu_hart_state[hartid].fw_counters_value[cidx - num_hw_ctrs];
 
 	return 0;
 }
@@ -362,8 +376,8 @@ static int pmu_ctr_start_fw(uint32_t cidx, uint32_t event_code,
 	int ret;
 	u32 hartid = current_hartid();
 
-	if (SBI_PMU_FW_MAX <= event_code &&
-	    pmu_dev && pmu_dev->fw_counter_start) {
+	if (pmu_fw_event_is_dev(event_code) &&
+	    pmu_dev->fw_counter_start) {
 		ret = pmu_dev->fw_counter_start(cidx - num_hw_ctrs,
 						event_code,
 						ival, ival_update);
@@ -372,8 +386,8 @@ static int pmu_ctr_start_fw(uint32_t cidx, uint32_t event_code,
 	}
 
 	if (ival_update)
-		fw_counters_value[hartid][cidx - num_hw_ctrs] = ival;
-	fw_counters_started[hartid] |= BIT(cidx - num_hw_ctrs);
+		pmu_hart_state[hartid].fw_counters_value[cidx - num_hw_ctrs] = ival;
+	pmu_hart_state[hartid].fw_counters_started |= BIT(cidx - num_hw_ctrs);
 
 	return 0;
 }
@@ -434,14 +448,14 @@ static int pmu_ctr_stop_fw(uint32_t cidx, uint32_t event_code)
 {
 	int ret;
 
-	if (SBI_PMU_FW_MAX <= event_code &&
-	    pmu_dev && pmu_dev->fw_counter_stop) {
+	if (pmu_fw_event_is_dev(event_code) &&
+	    pmu_dev->fw_counter_stop) {
 		ret = pmu_dev->fw_counter_stop(cidx - num_hw_ctrs);
 		if (ret)
 			return ret;
 	}
 
-	fw_counters_started[current_hartid()] &= ~BIT(cidx - num_hw_ctrs);
+	pmu_hart_state[current_hartid()].fw_counters_started &= ~BIT(cidx - num_hw_ctrs);
 
 	return 0;
 }
@@ -487,7 +501,7 @@ int sbi_pmu_ctr_stop(unsigned long cbase, unsigned long cmask,
 			ret = pmu_ctr_stop_hw(cidx);
 
 		if (flag & SBI_PMU_STOP_FLAG_RESET) {
-			active_events[hartid][cidx] = SBI_PMU_EVENT_IDX_INVALID;
+			pmu_hart_state[hartid].active_events[cidx] = SBI_PMU_EVENT_IDX_INVALID;
 			pmu_reset_hw_mhpmevent(cidx);
 		}
 	}
@@ -604,7 +618,7 @@ static int pmu_ctr_find_hw(unsigned long cbase, unsigned long cmask, unsigned lo
 			 * Some of the platform may not support mcountinhibit.
 			 * Checking the active_events is enough for them
 			 */
-			if (active_events[hartid][cbase] != SBI_PMU_EVENT_IDX_INVALID)
+			if (pmu_hart_state[hartid].active_events[cbase] != SBI_PMU_EVENT_IDX_INVALID)
 				continue;
 			/* If mcountinhibit is supported, the bit must be enabled */
 			if ((sbi_hart_priv_version(scratch) >= SBI_HART_PRIV_VER_1_11) &&
@@ -648,10 +662,10 @@ static int pmu_ctr_find_fw(unsigned long cbase, unsigned long cmask,
 		cidx = i + cbase;
 		if (cidx < num_hw_ctrs || total_ctrs <= cidx)
 			continue;
-		if (active_events[hartid][i] != SBI_PMU_EVENT_IDX_INVALID)
+		if (pmu_hart_state[hartid].active_events[i] != SBI_PMU_EVENT_IDX_INVALID)
 			continue;
-		if (SBI_PMU_FW_MAX <= event_code &&
-		    pmu_dev && pmu_dev->fw_counter_match_code) {
+		if (pmu_fw_event_is_dev(event_code) &&
+		    pmu_dev->fw_counter_match_code) {
 			if (!pmu_dev->fw_counter_match_code(cidx - num_hw_ctrs,
 							    event_code))
 				continue;
@@ -685,7 +699,7 @@ int sbi_pmu_ctr_cfg_match(unsigned long cidx_base, unsigned long cidx_mask,
 		 * counter idx for the given event. Verify that the counter idx
 		 * is still valid.
 		 */
-		if (active_events[hartid][cidx_base] == SBI_PMU_EVENT_IDX_INVALID)
+		if (pmu_hart_state[hartid].active_events[cidx_base] == SBI_PMU_EVENT_IDX_INVALID)
 			return SBI_EINVAL;
 		ctr_idx = cidx_base;
 		goto skip_match;
@@ -702,7 +716,7 @@ int sbi_pmu_ctr_cfg_match(unsigned long cidx_base, unsigned long cidx_mask,
 	if (ctr_idx < 0)
 		return SBI_ENOTSUPP;
 
-	active_events[hartid][ctr_idx] = event_idx;
+	pmu_hart_state[hartid].active_events[ctr_idx] = event_idx;
 skip_match:
 	if (event_type == SBI_PMU_EVENT_TYPE_HW) {
 		if (flags & SBI_PMU_CFG_FLAG_CLEAR_VALUE)
@@ -711,39 +725,36 @@ skip_match:
 			pmu_ctr_start_hw(ctr_idx, 0, false);
 	} else if (event_type == SBI_PMU_EVENT_TYPE_FW) {
 		if (flags & SBI_PMU_CFG_FLAG_CLEAR_VALUE)
-			fw_counters_value[hartid][ctr_idx - num_hw_ctrs] = 0;
+			pmu_hart_state[hartid].fw_counters_value[ctr_idx - num_hw_ctrs] = 0;
 		if (flags & SBI_PMU_CFG_FLAG_AUTO_START) {
-			if (SBI_PMU_FW_MAX <= event_code &&
-			    pmu_dev && pmu_dev->fw_counter_start) {
+			if (pmu_fw_event_is_dev(event_code) &&
+			    pmu_dev->fw_counter_start) {
 				ret = pmu_dev->fw_counter_start(
 					ctr_idx - num_hw_ctrs, event_code,
-					fw_counters_value[hartid][ctr_idx - num_hw_ctrs],
+					pmu_hart_state[hartid].fw_counters_value[ctr_idx - num_hw_ctrs],
 					true);
 				if (ret)
 					return ret;
 			}
-			fw_counters_started[hartid] |= BIT(ctr_idx - num_hw_ctrs);
+			pmu_hart_state[hartid].fw_counters_started |= BIT(ctr_idx - num_hw_ctrs);
 		}
 	}
 
 	return ctr_idx;
 }
 
-int sbi_pmu_ctr_incr_fw(enum sbi_pmu_fw_event_code_id fw_id)
+static int pmu_ctr_incr_fw(uint32_t fw_id)
 {
 	u32 cidx, hartid = current_hartid();
 	uint64_t *fcounter = NULL;
 
-	if (likely(!fw_counters_started[hartid]))
+	if (likely(!pmu_hart_state[hartid].fw_counters_started))
 		return 0;
 
-	if (unlikely(fw_id >= SBI_PMU_FW_MAX))
-		return SBI_EINVAL;
-
 	for (cidx = num_hw_ctrs; cidx < total_ctrs; cidx++) {
-		if (get_cidx_code(active_events[hartid][cidx]) == fw_id &&
-		    (fw_counters_started[hartid] & BIT(cidx - num_hw_ctrs))) {
-			fcounter = &fw_counters_value[hartid][cidx - num_hw_ctrs];
+		if (get_cidx_code(pmu_hart_state[hartid].active_events[cidx]) == fw_id &&
+		    (pmu_hart_state[hartid].fw_counters_started & BIT(cidx - num_hw_ctrs))) {
+			fcounter = &pmu_hart_state[hartid].fw_counters_value[cidx - num_hw_ctrs];
 			break;
 		}
 	}
@@ -754,6 +765,22 @@ int sbi_pmu_ctr_incr_fw(enum sbi_pmu_fw_event_code_id fw_id)
 	return 0;
 }
 
+int sbi_pmu_ctr_incr_fw(enum sbi_pmu_fw_event_code_id fw_id)
+{
+	if (unlikely(fw_id >= SBI_PMU_FW_MAX))
+		return SBI_EINVAL;
+
+	return pmu_ctr_incr_fw(fw_id);
+}
+
+int sbi_pmu_ctr_incr_fw_impl(enum sbi_pmu_fw_impl_event_code_id fw_id)
+{
+	if (unlikely(!pmu_fw_event_is_impl(fw_id)))
+		return SBI_EINVAL;
+
+	return pmu_ctr_incr_fw(fw_id);
+}
+
 unsigned long sbi_pmu_num_ctr(void)
 {
 	return (num_hw_ctrs + SBI_PMU_FW_CTR_MAX);
@@ -795,10 +822,10 @@ static void pmu_reset_event_map(u32 hartid)
 
 	/* Initialize the counter to event mapping table */
 	for (j = 3; j < total_ctrs; j++)
-		active_events[hartid][j] = SBI_PMU_EVENT_IDX_INVALID;
+		pmu_hart_state[hartid].active_events[j] = SBI_PMU_EVENT_IDX_INVALID;
 	for (j = 0; j < SBI_PMU_FW_CTR_MAX; j++)
-		fw_counters_value[hartid][j] = 0;
-	fw_counters_started[hartid] = 0;
+		pmu_hart_state[hartid].fw_counters_value[j] = 0;
+	pmu_hart_state[hartid].fw_counters_started = 0;
 }
 
 const struct sbi_pmu_device *sbi_pmu_get_device(void)
@@ -844,10 +871,10 @@ int sbi_pmu_init(struct sbi_scratch *scratch, bool cold_boot)
 	pmu_reset_event_map(hartid);
 
 	/* First three counters are fixed by the priv spec and we enable it by default */
-	active_events[hartid][0] = SBI_PMU_EVENT_TYPE_HW << SBI_PMU_EVENT_IDX_OFFSET |
+	pmu_hart_state[hartid].active_events[0] = SBI_PMU_EVENT_TYPE_HW << SBI_PMU_EVENT_IDX_OFFSET |
 				   SBI_PMU_HW_CPU_CYCLES;
-	active_events[hartid][1] = SBI_PMU_EVENT_IDX_INVALID;
-	active_events[hartid][2] = SBI_PMU_EVENT_TYPE_HW << SBI_PMU_EVENT_IDX_OFFSET |
+	pmu_hart_state[hartid].active_events[1] = SBI_PMU_EVENT_IDX_INVALID;
+	pmu_hart_state[hartid].active_events[2] = SBI_PMU_EVENT_TYPE_HW << SBI_PMU_EVENT_IDX_OFFSET |
 				   SBI_PMU_HW_INSTRUCTIONS;
 
 	return 0;
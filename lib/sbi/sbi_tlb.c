@@ -22,17 +22,123 @@
 #include <sbi/sbi_console.h>
 #include <sbi/sbi_platform.h>
 #include <sbi/sbi_pmu.h>
+#include <sm/sm.h>
+
+/*
+ * Per-hart queue of remote flush requests: a bounded multi-producer,
+ * single-consumer ring. A slot is free for position pos when its seq is
+ * pos, and holds the entry of pos when seq is pos + 1. Senders claim a
+ * position with a CAS on tail and publish the entry with a release of
+ * seq, so they never take a lock of the target hart. Only the owning
+ * hart consumes, from the IPI handler or while it waits in tlb_sync.
+ */
+#define TLB_RING_MASK	(SBI_TLB_FIFO_NUM_ENTRIES - 1)
+
+#if SBI_TLB_FIFO_NUM_ENTRIES & TLB_RING_MASK
+#error "SBI_TLB_FIFO_NUM_ENTRIES must be a power of 2"
+#endif
+
+struct tlb_ring_slot {
+	volatile unsigned long seq;
+	struct sbi_tlb_info info;
+};
+
+struct tlb_ring {
+	atomic_t tail;		/* next position claimed by a sender */
+	unsigned long head;	/* next position consumed by the owner */
+	unsigned long flush_limit; /* bigger ranges are flushed whole */
+	struct tlb_ring_slot slots[SBI_TLB_FIFO_NUM_ENTRIES];
+};
 
 static unsigned long tlb_sync_off;
-static unsigned long tlb_fifo_off;
-static unsigned long tlb_fifo_mem_off;
-static unsigned long tlb_range_flush_limit;
+static unsigned long tlb_ring_off;
+
+/* Ranged flushes with Svinval stay cheap for this many more pages */
+#define TLB_SVINVAL_FLUSH_LIMIT_SCALE	8
+
+/* sbi_tlb_info is only made of longs, copy it a word at a time */
+static inline void tlb_info_copy(struct sbi_tlb_info *dst,
+				 const struct sbi_tlb_info *src)
+{
+	unsigned long *d = (unsigned long *)dst;
+	const unsigned long *s = (const unsigned long *)src;
+	unsigned long i;
+
+	for (i = 0; i < sizeof(*dst) / sizeof(unsigned long); i++)
+		d[i] = s[i];
+}
+
+static void tlb_ring_init(struct tlb_ring *ring)
+{
+	unsigned long i;
+
+	ATOMIC_INIT(&ring->tail, 0);
+	ring->head = 0;
+	for (i = 0; i < SBI_TLB_FIFO_NUM_ENTRIES; i++)
+		ring->slots[i].seq = i;
+}
+
+/* Called by any hart, returns SBI_ENOSPC if the ring is full */
+static int tlb_ring_enqueue(struct tlb_ring *ring,
+			    const struct sbi_tlb_info *tinfo)
+{
+	struct tlb_ring_slot *slot;
+	unsigned long pos = atomic_read(&ring->tail), seq;
+	long diff;
+
+	while (1) {
+		slot = &ring->slots[pos & TLB_RING_MASK];
+		seq  = __smp_load_acquire(&slot->seq);
+		diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (atomic_cmpxchg(&ring->tail, pos, pos + 1) == pos)
+				break;
+			pos = atomic_read(&ring->tail);
+		} else if (diff < 0) {
+			return SBI_ENOSPC;
+		} else {
+			pos = atomic_read(&ring->tail);
+		}
+	}
+
+	tlb_info_copy(&slot->info, tinfo);
+	__smp_store_release(&slot->seq, pos + 1);
+
+	return 0;
+}
+
+/* Called by the owning hart only, returns SBI_ENOENT if the ring is empty */
+static int tlb_ring_dequeue(struct tlb_ring *ring, struct sbi_tlb_info *tinfo)
+{
+	struct tlb_ring_slot *slot = &ring->slots[ring->head & TLB_RING_MASK];
+
+	if (__smp_load_acquire(&slot->seq) != ring->head + 1)
+		return SBI_ENOENT;
+
+	tlb_info_copy(tinfo, &slot->info);
+	__smp_store_release(&slot->seq,
+			    ring->head + SBI_TLB_FIFO_NUM_ENTRIES);
+	ring->head++;
+
+	return 0;
+}
 
 static void tlb_flush_all(void)
 {
 	__asm__ __volatile("sfence.vma");
 }
 
+/*
+ * With Svinval, a ranged flush is a batch of sinval/hinval between one
+ * sfence.w.inval and one sfence.inval.ir instead of a fully ordering
+ * fence per page.
+ */
+static inline bool tlb_has_svinval(void)
+{
+	return sbi_hart_has_extension(sbi_scratch_thishart_ptr(),
+				      SBI_HART_EXT_SVINVAL);
+}
+
 void sbi_tlb_local_hfence_vvma(struct sbi_tlb_info *tinfo)
 {
 	unsigned long start = tinfo->start;
@@ -50,6 +156,14 @@ void sbi_tlb_local_hfence_vvma(struct sbi_tlb_info *tinfo)
 		goto done;
 	}
 
+	if (tlb_has_svinval()) {
+		__sbi_sfence_w_inval();
+		for (i = 0; i < size; i += PAGE_SIZE)
+			__sbi_hinval_vvma_va(start + i);
+		__sbi_sfence_inval_ir();
+		goto done;
+	}
+
 	for (i = 0; i < size; i += PAGE_SIZE) {
 		__sbi_hfence_vvma_va(start+i);
 	}
@@ -65,12 +179,21 @@ void sbi_tlb_local_hfence_gvma(struct sbi_tlb_info *tinfo)
 	unsigned long i;
 
 	sbi_pmu_ctr_incr_fw(SBI_PMU_FW_HFENCE_GVMA_RCVD);
+	sm_gpa_cache_flush(0, true);
 
 	if ((start == 0 && size == 0) || (size == SBI_TLB_FLUSH_ALL)) {
 		__sbi_hfence_gvma_all();
 		return;
 	}
 
+	if (tlb_has_svinval()) {
+		__sbi_sfence_w_inval();
+		for (i = 0; i < size; i += PAGE_SIZE)
+			__sbi_hinval_gvma_gpa((start + i) >> 2);
+		__sbi_sfence_inval_ir();
+		return;
+	}
+
 	for (i = 0; i < size; i += PAGE_SIZE) {
 		__sbi_hfence_gvma_gpa((start + i) >> 2);
 	}
@@ -89,6 +212,14 @@ void sbi_tlb_local_sfence_vma(struct sbi_tlb_info *tinfo)
 		return;
 	}
 
+	if (tlb_has_svinval()) {
+		__sbi_sfence_w_inval();
+		for (i = 0; i < size; i += PAGE_SIZE)
+			__sbi_sinval_vma_va(start + i);
+		__sbi_sfence_inval_ir();
+		return;
+	}
+
 	for (i = 0; i < size; i += PAGE_SIZE) {
 		__asm__ __volatile__("sfence.vma %0"
 				     :
@@ -120,6 +251,14 @@ void sbi_tlb_local_hfence_vvma_asid(struct sbi_tlb_info *tinfo)
 		goto done;
 	}
 
+	if (tlb_has_svinval()) {
+		__sbi_sfence_w_inval();
+		for (i = 0; i < size; i += PAGE_SIZE)
+			__sbi_hinval_vvma_asid_va(start + i, asid);
+		__sbi_sfence_inval_ir();
+		goto done;
+	}
+
 	for (i = 0; i < size; i += PAGE_SIZE) {
 		__sbi_hfence_vvma_asid_va(start + i, asid);
 	}
@@ -136,6 +275,7 @@ void sbi_tlb_local_hfence_gvma_vmid(struct sbi_tlb_info *tinfo)
 	unsigned long i;
 
 	sbi_pmu_ctr_incr_fw(SBI_PMU_FW_HFENCE_GVMA_VMID_RCVD);
+	sm_gpa_cache_flush(vmid, start == 0 && size == 0);
 
 	if (start == 0 && size == 0) {
 		__sbi_hfence_gvma_all();
@@ -147,6 +287,14 @@ void sbi_tlb_local_hfence_gvma_vmid(struct sbi_tlb_info *tinfo)
 		return;
 	}
 
+	if (tlb_has_svinval()) {
+		__sbi_sfence_w_inval();
+		for (i = 0; i < size; i += PAGE_SIZE)
+			__sbi_hinval_gvma_vmid_gpa((start + i) >> 2, vmid);
+		__sbi_sfence_inval_ir();
+		return;
+	}
+
 	for (i = 0; i < size; i += PAGE_SIZE) {
 		__sbi_hfence_gvma_vmid_gpa((start + i) >> 2, vmid);
 	}
@@ -175,6 +323,14 @@ void sbi_tlb_local_sfence_vma_asid(struct sbi_tlb_info *tinfo)
 		return;
 	}
 
+	if (tlb_has_svinval()) {
+		__sbi_sfence_w_inval();
+		for (i = 0; i < size; i += PAGE_SIZE)
+			__sbi_sinval_vma_asid_va(start + i, asid);
+		__sbi_sfence_inval_ir();
+		return;
+	}
+
 	for (i = 0; i < size; i += PAGE_SIZE) {
 		__asm__ __volatile__("sfence.vma %0, %1"
 				     :
@@ -215,7 +371,7 @@ static void tlb_entry_process(struct sbi_tlb_info *tinfo)
 {
 	u32 rhartid;
 	struct sbi_scratch *rscratch = NULL;
-	unsigned long *rtlb_sync = NULL;
+	atomic_t *rtlb_sync = NULL;
 
 	tinfo->local_fn(tinfo);
 
@@ -225,45 +381,61 @@ static void tlb_entry_process(struct sbi_tlb_info *tinfo)
 			continue;
 
 		rtlb_sync = sbi_scratch_offset_ptr(rscratch, tlb_sync_off);
-		while (atomic_raw_xchg_ulong(rtlb_sync, 1)) ;
+		atomic_sub_return(rtlb_sync, 1);
 	}
 }
 
-static void tlb_process_count(struct sbi_scratch *scratch, int count)
+static int tlb_update_cb(void *in, void *data);
+
+/*
+ * Drain up to count requests of this hart's ring and process them. The
+ * requests are coalesced here, by the consumer, so that senders never
+ * touch entries that are already queued.
+ */
+static int tlb_process_count(struct sbi_scratch *scratch, int count)
 {
-	struct sbi_tlb_info tinfo;
-	unsigned int deq_count = 0;
-	struct sbi_fifo *tlb_fifo =
-			sbi_scratch_offset_ptr(scratch, tlb_fifo_off);
+	struct sbi_tlb_info batch[SBI_TLB_FIFO_NUM_ENTRIES];
+	struct tlb_ring *ring = sbi_scratch_offset_ptr(scratch, tlb_ring_off);
+	int i, num = 0, deq_count = 0;
 
-	while (!sbi_fifo_dequeue(tlb_fifo, &tinfo)) {
-		tlb_entry_process(&tinfo);
-		deq_count++;
-		if (deq_count > count)
-			break;
+	if (count > SBI_TLB_FIFO_NUM_ENTRIES)
+		count = SBI_TLB_FIFO_NUM_ENTRIES;
 
+	while (count-- && !tlb_ring_dequeue(ring, &batch[num])) {
+		deq_count++;
+		for (i = 0; i < num; i++) {
+			if (tlb_update_cb(&batch[num], &batch[i]) !=
+			    SBI_FIFO_UNCHANGED)
+				break;
+		}
+		/* Not merged into an earlier request */
+		if (i == num)
+			num++;
+		else
+			sbi_pmu_ctr_incr_fw_impl(SBI_PMU_FW_TLB_REQ_MERGED);
 	}
+
+	for (i = 0; i < num; i++)
+		tlb_entry_process(&batch[i]);
+
+	return deq_count;
 }
 
 static void tlb_process(struct sbi_scratch *scratch)
 {
-	struct sbi_tlb_info tinfo;
-	struct sbi_fifo *tlb_fifo =
-			sbi_scratch_offset_ptr(scratch, tlb_fifo_off);
-
-	while (!sbi_fifo_dequeue(tlb_fifo, &tinfo))
-		tlb_entry_process(&tinfo);
+	while (tlb_process_count(scratch, SBI_TLB_FIFO_NUM_ENTRIES))
+		;
 }
 
 static void tlb_sync(struct sbi_scratch *scratch)
 {
-	unsigned long *tlb_sync =
+	atomic_t *tlb_sync =
 			sbi_scratch_offset_ptr(scratch, tlb_sync_off);
 
-	while (!atomic_raw_xchg_ulong(tlb_sync, 0)) {
+	while (atomic_read(tlb_sync) > 0) {
 		/*
-		 * While we are waiting for remote hart to set the sync,
-		 * consume fifo requests to avoid deadlock.
+		 * While we are waiting for remote harts to complete,
+		 * consume ring requests to avoid deadlock.
 		 */
 		tlb_process_count(scratch, 1);
 	}
@@ -271,48 +443,110 @@ static void tlb_sync(struct sbi_scratch *scratch)
 	return;
 }
 
+/*
+ * The request flushes everything its local_fn can, whatever the ASID. The
+ * HFENCE.VVMA ones still only flush the VMID they run with in hgatp.
+ */
+static inline bool tlb_is_flush_global(struct sbi_tlb_info *tinfo)
+{
+	return tinfo->start == 0 && tinfo->size == 0;
+}
+
+static inline bool tlb_vmid_local(struct sbi_tlb_info *tinfo)
+{
+	return tinfo->local_fn == sbi_tlb_local_hfence_vvma ||
+	       tinfo->local_fn == sbi_tlb_local_hfence_vvma_asid;
+}
+
+/* Both requests flush translations of the same ASID and/or VMID */
+static inline bool tlb_same_scope(struct sbi_tlb_info *curr,
+				  struct sbi_tlb_info *next)
+{
+	if (curr->local_fn == sbi_tlb_local_sfence_vma_asid)
+		return curr->asid == next->asid;
+	if (curr->local_fn == sbi_tlb_local_hfence_gvma_vmid ||
+	    curr->local_fn == sbi_tlb_local_hfence_vvma)
+		return curr->vmid == next->vmid;
+	if (curr->local_fn == sbi_tlb_local_hfence_vvma_asid)
+		return curr->vmid == next->vmid && curr->asid == next->asid;
+
+	return true;
+}
+
 static inline int tlb_range_check(struct sbi_tlb_info *curr,
 					struct sbi_tlb_info *next)
 {
 	unsigned long curr_end;
 	unsigned long next_end;
+	struct tlb_ring *ring;
 	int ret = SBI_FIFO_UNCHANGED;
 
 	if (!curr || !next)
 		return ret;
 
+	if (curr->size == SBI_TLB_FLUSH_ALL) {
+		sbi_hartmask_or(&curr->smask, &curr->smask, &next->smask);
+		return SBI_FIFO_SKIP;
+	}
+	if (next->size == SBI_TLB_FLUSH_ALL) {
+		curr->start = 0;
+		curr->size  = SBI_TLB_FLUSH_ALL;
+		sbi_hartmask_or(&curr->smask, &curr->smask, &next->smask);
+		return SBI_FIFO_UPDATED;
+	}
+
 	next_end = next->start + next->size;
 	curr_end = curr->start + curr->size;
-	if (next->start <= curr->start && next_end > curr_end) {
-		curr->start = next->start;
-		curr->size  = next->size;
-		sbi_hartmask_or(&curr->smask, &curr->smask, &next->smask);
-		ret = SBI_FIFO_UPDATED;
+	if (next->start > curr_end || curr->start > next_end) {
+		/* Disjoint and not adjacent */
+		return ret;
 	} else if (next->start >= curr->start && next_end <= curr_end) {
 		sbi_hartmask_or(&curr->smask, &curr->smask, &next->smask);
 		ret = SBI_FIFO_SKIP;
+	} else {
+		if (next->start < curr->start)
+			curr->start = next->start;
+		if (next_end > curr_end)
+			curr_end = next_end;
+		curr->size = curr_end - curr->start;
+		/* Only the owner of the ring merges, its own limit applies */
+		ring = sbi_scratch_thishart_offset_ptr(tlb_ring_off);
+		if (curr->size > ring->flush_limit) {
+			curr->start = 0;
+			curr->size  = SBI_TLB_FLUSH_ALL;
+		}
+		sbi_hartmask_or(&curr->smask, &curr->smask, &next->smask);
+		ret = SBI_FIFO_UPDATED;
 	}
 
 	return ret;
 }
 
 /**
- * Call back to decide if an inplace fifo update is required or next entry can
- * can be skipped. Here are the different cases that are being handled.
+ * Call back to decide if a dequeued request can be merged into an earlier
+ * one of the same drain. Only requests with the same local_fn are merged,
+ * here are the different cases that are being handled.
  *
  * Case1:
- *	if next flush request range lies within one of the existing entry, skip
- *	the next entry.
+ *	FENCE.I requests carry no range, repeated ones are skipped.
  * Case2:
- *	if flush request range in current fifo entry lies within next flush
- *	request, update the current entry.
+ *	if the current entry flushes everything (start == 0 and size == 0),
+ *	skip the next entry whatever its ASID/VMID. If the next entry flushes
+ *	everything, the current entry is updated to do so. HFENCE.VVMA ones
+ *	only flush everything of their VMID, so the VMID must match.
+ * Case3:
+ *	otherwise the entries must have the same scope: the ASID for
+ *	SFENCE.VMA.ASID, the VMID for HFENCE.GVMA.VMID and HFENCE.VVMA, both
+ *	for HFENCE.VVMA.ASID. A flush-all of the scope absorbs the other
+ *	entry, and adjacent or overlapping ranges are merged into their
+ *	union, which is upgraded to a flush-all of the scope when it gets
+ *	bigger than the flush limit.
  *
  * Note:
- *	We can not issue a fifo reset anymore if a complete vma flush is requested.
+ *	We can not drop the queued requests if a complete vma flush is requested.
  *	This is because we are queueing FENCE.I requests as well now.
- *	To ease up the pressure in enqueue/fifo sync path, try to dequeue 1 element
- *	before continuing the while loop. This method is preferred over wfi/ipi because
- *	of MMIO cost involved in later method.
+ *	The merged requests carry the union of the senders in smask, each sender
+ *	has at most one request in the ring so it is still acknowledged once.
  */
 static int tlb_update_cb(void *in, void *data)
 {
@@ -326,12 +560,21 @@ static int tlb_update_cb(void *in, void *data)
 	curr = (struct sbi_tlb_info *)data;
 	next = (struct sbi_tlb_info *)in;
 
-	if (next->local_fn == sbi_tlb_local_sfence_vma_asid &&
-	    curr->local_fn == sbi_tlb_local_sfence_vma_asid) {
-		if (next->asid == curr->asid)
-			ret = tlb_range_check(curr, next);
-	} else if (next->local_fn == sbi_tlb_local_sfence_vma &&
-		   curr->local_fn == sbi_tlb_local_sfence_vma) {
+	if (next->local_fn != curr->local_fn)
+		return ret;
+	if (tlb_vmid_local(curr) && curr->vmid != next->vmid)
+		return ret;
+
+	if (curr->local_fn == sbi_tlb_local_fence_i ||
+	    tlb_is_flush_global(curr)) {
+		sbi_hartmask_or(&curr->smask, &curr->smask, &next->smask);
+		ret = SBI_FIFO_SKIP;
+	} else if (tlb_is_flush_global(next)) {
+		curr->start = 0;
+		curr->size  = 0;
+		sbi_hartmask_or(&curr->smask, &curr->smask, &next->smask);
+		ret = SBI_FIFO_UPDATED;
+	} else if (tlb_same_scope(curr, next)) {
 		ret = tlb_range_check(curr, next);
 	}
 
@@ -342,19 +585,25 @@ static int tlb_update(struct sbi_scratch *scratch,
 			  struct sbi_scratch *remote_scratch,
 			  u32 remote_hartid, void *data)
 {
-	int ret;
-	struct sbi_fifo *tlb_fifo_r;
+	struct tlb_ring *tlb_ring_r;
+	struct sbi_tlb_info full;
 	struct sbi_tlb_info *tinfo = data;
 	u32 curr_hartid = current_hartid();
 
+	tlb_ring_r = sbi_scratch_offset_ptr(remote_scratch, tlb_ring_off);
+
 	/*
-	 * If address range to flush is too big then simply
-	 * upgrade it to flush all because we can only flush
-	 * 4KB at a time.
+	 * If address range to flush is too big for the target then
+	 * simply upgrade it to flush all because we can only flush
+	 * 4KB at a time. The limit depends on the target having
+	 * Svinval, so upgrade a copy and leave the other targets'
+	 * request alone.
 	 */
-	if (tinfo->size > tlb_range_flush_limit) {
-		tinfo->start = 0;
-		tinfo->size = SBI_TLB_FLUSH_ALL;
+	if (tinfo->size > tlb_ring_r->flush_limit) {
+		tlb_info_copy(&full, tinfo);
+		full.start = 0;
+		full.size  = SBI_TLB_FLUSH_ALL;
+		tinfo = &full;
 	}
 
 	/*
@@ -366,26 +615,26 @@ static int tlb_update(struct sbi_scratch *scratch,
 		return -1;
 	}
 
-	tlb_fifo_r = sbi_scratch_offset_ptr(remote_scratch, tlb_fifo_off);
-
-	ret = sbi_fifo_inplace_update(tlb_fifo_r, data, tlb_update_cb);
-	if (ret != SBI_FIFO_UNCHANGED) {
-		return 1;
-	}
+	/*
+	 * One completion per target, also when the target merges the
+	 * request into another one that then carries this hart in smask.
+	 */
+	atomic_add_return(sbi_scratch_offset_ptr(scratch, tlb_sync_off), 1);
 
-	while (sbi_fifo_enqueue(tlb_fifo_r, data) < 0) {
+	while (tlb_ring_enqueue(tlb_ring_r, tinfo) < 0) {
 		/**
-		 * For now, Busy loop until there is space in the fifo.
+		 * For now, Busy loop until there is space in the ring.
 		 * There may be case where target hart is also
-		 * enqueue in source hart's fifo. Both hart may busy
+		 * enqueue in source hart's ring. Both hart may busy
 		 * loop leading to a deadlock.
 		 * TODO: Introduce a wait/wakeup event mechanism to handle
 		 * this properly.
 		 */
 		tlb_process_count(scratch, 1);
-		sbi_dprintf("hart%d: hart%d tlb fifo full\n",
+		sbi_dprintf("hart%d: hart%d tlb ring full\n",
 			    curr_hartid, remote_hartid);
 	}
+	sbi_pmu_ctr_incr_fw_impl(SBI_PMU_FW_TLB_REQ_ENQUEUED);
 
 	return 0;
 }
@@ -412,53 +661,45 @@ int sbi_tlb_request(ulong hmask, ulong hbase, struct sbi_tlb_info *tinfo)
 int sbi_tlb_init(struct sbi_scratch *scratch, bool cold_boot)
 {
 	int ret;
-	void *tlb_mem;
-	unsigned long *tlb_sync;
-	struct sbi_fifo *tlb_q;
+	atomic_t *tlb_sync;
+	struct tlb_ring *tlb_ring;
 	const struct sbi_platform *plat = sbi_platform_ptr(scratch);
 
 	if (cold_boot) {
 		tlb_sync_off = sbi_scratch_alloc_offset(sizeof(*tlb_sync));
 		if (!tlb_sync_off)
 			return SBI_ENOMEM;
-		tlb_fifo_off = sbi_scratch_alloc_offset(sizeof(*tlb_q));
-		if (!tlb_fifo_off) {
-			sbi_scratch_free_offset(tlb_sync_off);
-			return SBI_ENOMEM;
-		}
-		tlb_fifo_mem_off = sbi_scratch_alloc_offset(
-				SBI_TLB_FIFO_NUM_ENTRIES * SBI_TLB_INFO_SIZE);
-		if (!tlb_fifo_mem_off) {
-			sbi_scratch_free_offset(tlb_fifo_off);
+		tlb_ring_off = sbi_scratch_alloc_offset(sizeof(*tlb_ring));
+		if (!tlb_ring_off) {
 			sbi_scratch_free_offset(tlb_sync_off);
 			return SBI_ENOMEM;
 		}
 		ret = sbi_ipi_event_create(&tlb_ops);
 		if (ret < 0) {
-			sbi_scratch_free_offset(tlb_fifo_mem_off);
-			sbi_scratch_free_offset(tlb_fifo_off);
+			sbi_scratch_free_offset(tlb_ring_off);
 			sbi_scratch_free_offset(tlb_sync_off);
 			return ret;
 		}
 		tlb_event = ret;
-		tlb_range_flush_limit = sbi_platform_tlbr_flush_limit(plat);
 	} else {
 		if (!tlb_sync_off ||
-		    !tlb_fifo_off ||
-		    !tlb_fifo_mem_off)
+		    !tlb_ring_off)
 			return SBI_ENOMEM;
 		if (SBI_IPI_EVENT_MAX <= tlb_event)
 			return SBI_ENOSPC;
 	}
 
 	tlb_sync = sbi_scratch_offset_ptr(scratch, tlb_sync_off);
-	tlb_q = sbi_scratch_offset_ptr(scratch, tlb_fifo_off);
-	tlb_mem = sbi_scratch_offset_ptr(scratch, tlb_fifo_mem_off);
+	tlb_ring = sbi_scratch_offset_ptr(scratch, tlb_ring_off);
+
+	ATOMIC_INIT(tlb_sync, 0);
 
-	*tlb_sync = 0;
+	tlb_ring_init(tlb_ring);
 
-	sbi_fifo_init(tlb_q, tlb_mem,
-		      SBI_TLB_FIFO_NUM_ENTRIES, SBI_TLB_INFO_SIZE);
+	/* Svinval is per hart, so is the limit it raises */
+	tlb_ring->flush_limit = sbi_platform_tlbr_flush_limit(plat);
+	if (sbi_hart_has_extension(scratch, SBI_HART_EXT_SVINVAL))
+		tlb_ring->flush_limit *= TLB_SVINVAL_FLUSH_LIMIT_SCALE;
 
 	return 0;
 }
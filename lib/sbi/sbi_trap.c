@@ -280,6 +280,11 @@ struct sbi_trap_regs *sbi_trap_handler(struct sbi_trap_regs *regs)
 	ulong mtval = csr_read(CSR_MTVAL), mtval2 = 0, mtinst = 0;
 	struct sbi_trap_info trap;
 
+	// TVM traps of the host, before anything else is looked at
+	if (mcause == CAUSE_ILLEGAL_INSTRUCTION &&
+	    !sbi_illegal_insn_tvm_fast(mtval, regs))
+		return regs;
+
 	if (misa_extension('H')) {
 		mtval2 = csr_read(CSR_MTVAL2);
 		mtinst = csr_read(CSR_MTINST);
@@ -339,6 +344,11 @@ struct sbi_trap_regs *sbi_trap_handler(struct sbi_trap_regs *regs)
 			rc = sbi_ecall_handler(regs);
 			break;
 		}
+		if (mcause == CAUSE_VIRTUAL_SUPERVISOR_ECALL &&
+		    !sm_guest_ecall(regs)) {
+			rc = 0;
+			break;
+		}
 		/* If the trap came from S or U mode, redirect it there */
 		trap.epc = regs->mepc;
 		trap.cause = mcause;
@@ -30,7 +30,7 @@ static void sbi_process_tvm(struct sbi_scratch *scratch)
 		sbi_scratch_offset_ptr(scratch, tvm_data_offset);
 	struct sbi_scratch *rscratch = NULL;
 	u32 rhartid;
-	unsigned long *tvm_sync = NULL;
+	atomic_t *tvm_sync = NULL;
 	tvm_set();
 
 	// sync
@@ -40,8 +40,7 @@ static void sbi_process_tvm(struct sbi_scratch *scratch)
 		if (!rscratch)
 			continue;
 		tvm_sync = sbi_scratch_offset_ptr(rscratch, tvm_sync_offset);
-		while (atomic_raw_xchg_ulong(tvm_sync, 1))
-			;
+		atomic_sub_return(tvm_sync, 1);
 	}
 }
 
@@ -61,16 +60,18 @@ static int sbi_update_tvm(struct sbi_scratch *scratch,
 	tvm_data = sbi_scratch_offset_ptr(remote_scratch, tvm_data_offset);
 	// update the remote hart tvm data
 	sbi_memcpy(tvm_data, data, sizeof(struct tvm_data_t));
+	// the remote hart completes it in sbi_process_tvm
+	atomic_add_return(sbi_scratch_offset_ptr(scratch, tvm_sync_offset), 1);
 
 	return 0;
 }
 
 static void sbi_tvm_sync(struct sbi_scratch *scratch)
 {
-	unsigned long *tvm_sync =
+	atomic_t *tvm_sync =
 		sbi_scratch_offset_ptr(scratch, tvm_sync_offset);
-	// wait the remote hart process the tvm signal
-	while (!atomic_raw_xchg_ulong(tvm_sync, 0))
+	// wait for all the remote harts to process the tvm signal
+	while (atomic_read(tvm_sync) > 0)
 		;
 	return;
 }
@@ -93,7 +94,7 @@ int sbi_tvm_init(struct sbi_scratch *scratch, bool cold_boot)
 {
 	int ret;
 	struct tvm_data_t *tvmdata;
-	unsigned long *tvm_sync;
+	atomic_t *tvm_sync;
 
 	if (cold_boot) {
 		// Define the tvm data offset in the scratch
@@ -109,7 +110,7 @@ int sbi_tvm_init(struct sbi_scratch *scratch, bool cold_boot)
 
 		tvm_sync = sbi_scratch_offset_ptr(scratch, tvm_sync_offset);
 
-		*tvm_sync = 0;
+		ATOMIC_INIT(tvm_sync, 0);
 
 		ret = sbi_ipi_event_create(&tvm_ops);
 		if (ret < 0) {
@@ -132,7 +133,9 @@ int set_tvm_and_sync()
 	tvm_set();
 
 	// sync all other harts
-	SBI_HARTMASK_INIT_EXCEPT(&(tvm_data.smask), source_hart);
+	// only this hart waits for the completions
+	SBI_HARTMASK_INIT(&(tvm_data.smask));
+	sbi_hartmask_set_hart(source_hart, &(tvm_data.smask));
 	sbi_send_tvm(0xFFFFFFFF & (~(1 << source_hart)), 0, &tvm_data);
 	return 0;
 }
@@ -2,19 +2,38 @@
 #include <sbi/riscv_asm.h>
 #include <sbi/sbi_console.h>
 
-typedef u8 page_meta_t;
-#define PUBLIC_PAGE ((page_meta_t)0xFF)
-#define PRIVATE_PAGE ((page_meta_t)0x00)
-#define SHARED_PAGE ((page_meta_t)0x0F)
-#define IS_PUBLIC_PAGE(meta) (meta == PUBLIC_PAGE)
-#define IS_PRIVATE_PAGE(meta) (!meta)
-#define IS_SHARED_PAGE(meta) (meta == SHARED_PAGE)
-#define IS_PUBLIC_OR_SHARED_PAGE(meta) (!!meta)
+/*
+ * Page metadata is packed 2 bits per page, 32 pages per 64-bit word.
+ * A page is private iff both of its bits are clear, so "contains a
+ * private page" can be tested for a whole word with mask arithmetic.
+ */
+typedef u64 page_meta_t;
+#define PAGE_META_BITS 2
+#define PAGES_PER_META (64 / PAGE_META_BITS)
+#define PAGES_PER_META_SHIFT 5
+#define PAGE_META_LOW_BITS ((page_meta_t)0x5555555555555555ULL)
+#define PUBLIC_PAGE ((page_meta_t)0xFFFFFFFFFFFFFFFFULL)
+#define PRIVATE_PAGE ((page_meta_t)0x0000000000000000ULL)
+#define SHARED_PAGE PAGE_META_LOW_BITS
+
+/*
+ * Summary levels: the number of private pages in every 2MB and every 1GB
+ * region, kept up to date by the set_*_range functions. A range test
+ * that covers whole aligned regions (i.e. a huge page leaf) only has to
+ * look at the counters.
+ */
+#define PMD_PAGES_SHIFT 9
+#define PMD_PAGES (1UL << PMD_PAGES_SHIFT)
+#define PMD_METAS (PMD_PAGES / PAGES_PER_META)
+#define PGD_PAGES_SHIFT 18
+#define PGD_PAGES (1UL << PGD_PAGES_SHIFT)
 
 spinlock_t bitmap_lock = SPIN_LOCK_INITIALIZER;
 
 static bool bitmap_initialized = false;
 static page_meta_t *bitmap;
+static u32 *pgd_private_cnt;
+static u16 *pmd_private_cnt;
 uint64_t bitmap_len;
 
 // page table entry to page frame number
@@ -23,19 +42,66 @@ inline uint64_t pte_to_pfn(uintptr_t pte)
 	return pte >> PTE_PPN_SHIFT;
 }
 
+// mask covering the metadata of pages [first, first + num) inside one word
+static inline page_meta_t meta_mask(uint64_t first, uint64_t num)
+{
+	page_meta_t mask = (num >= PAGES_PER_META)
+				   ? PUBLIC_PAGE
+				   : ((page_meta_t)1 << (num * PAGE_META_BITS)) - 1;
+	return mask << (first * PAGE_META_BITS);
+}
+
+// one bit (the low bit of each page) set for every private page in meta
+static inline page_meta_t private_pages(page_meta_t meta)
+{
+	return ~(meta | (meta >> 1)) & PAGE_META_LOW_BITS;
+}
+
+// number of bits set in a word whose set bits are all in PAGE_META_LOW_BITS
+static inline uint64_t count_pages(page_meta_t bits)
+{
+	bits = (bits & 0x3333333333333333ULL) +
+	       ((bits >> 2) & 0x3333333333333333ULL);
+	bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (bits * 0x0101010101010101ULL) >> 56;
+}
+
+static inline uint64_t pgd_cnt_len(uint64_t pmd_regions)
+{
+	return (pmd_regions + (PGD_PAGES / PMD_PAGES) - 1) >>
+	       (PGD_PAGES_SHIFT - PMD_PAGES_SHIFT);
+}
+
 int init_bitmap(uintptr_t paddr_start, uint64_t bitmap_memory_size)
 {
+	/*
+	 * The memory is split into [page metadata][1GB counters][2MB counters],
+	 * sized to cover as many whole 2MB regions as possible.
+	 */
+	const uint64_t pmd_bytes =
+		PMD_METAS * sizeof(page_meta_t) + sizeof(*pmd_private_cnt);
+	uint64_t pmd_regions = bitmap_memory_size / pmd_bytes;
+	while (pmd_regions &&
+	       pmd_regions * pmd_bytes +
+			       pgd_cnt_len(pmd_regions) *
+				       sizeof(*pgd_private_cnt) >
+		       bitmap_memory_size)
+		pmd_regions--;
+
+	uint64_t words	   = pmd_regions * PMD_METAS;
+	uint64_t pgd_len   = pgd_cnt_len(pmd_regions);
 	bitmap_initialized = true;
 	bitmap		   = (page_meta_t *)paddr_start;
-	bitmap_len	   = bitmap_memory_size / sizeof(page_meta_t);
-
-	page_meta_t *meta = bitmap;
-	uintptr_t cur	  = 0;
-	while (cur < bitmap_memory_size) {
-		*meta = PUBLIC_PAGE;
-		meta += 1;
-		cur += sizeof(page_meta_t);
-	}
+	pgd_private_cnt	   = (u32 *)&bitmap[words];
+	pmd_private_cnt	   = (u16 *)&pgd_private_cnt[pgd_len];
+	bitmap_len	   = pmd_regions << PMD_PAGES_SHIFT;
+
+	for (uint64_t i = 0; i < words; i++)
+		bitmap[i] = PUBLIC_PAGE;
+	for (uint64_t i = 0; i < pgd_len; i++)
+		pgd_private_cnt[i] = 0;
+	for (uint64_t i = 0; i < pmd_regions; i++)
+		pmd_private_cnt[i] = 0;
 
 	return 0;
 }
@@ -59,21 +125,121 @@ int init_bitmap(uintptr_t paddr_start, uint64_t bitmap_memory_size)
 		return -1;                                                   \
 	}
 
+/*
+ * Scan [idx, idx + num) of the bitmap for a private page.
+ * Only the partial words at both ends need masking.
+ */
+static bool scan_private(uint64_t idx, uint64_t num)
+{
+	page_meta_t *meta = &bitmap[idx >> PAGES_PER_META_SHIFT];
+	uint64_t first	  = idx & (PAGES_PER_META - 1);
+
+	if (first) {
+		uint64_t cnt = PAGES_PER_META - first;
+		if (cnt > num)
+			cnt = num;
+		if (private_pages(*meta) & meta_mask(first, cnt))
+			return true;
+		meta++;
+		num -= cnt;
+	}
+	while (num >= PAGES_PER_META) {
+		if (private_pages(*meta))
+			return true;
+		meta++;
+		num -= PAGES_PER_META;
+	}
+	if (num && (private_pages(*meta) & meta_mask(0, num)))
+		return true;
+
+	return false;
+}
+
+// check [idx, idx + num) for a private page, using the summary levels
+static bool find_private(uint64_t idx, uint64_t num)
+{
+	while (num) {
+		uint64_t cnt;
+		if (!(idx & (PGD_PAGES - 1)) && num >= PGD_PAGES) {
+			if (pgd_private_cnt[idx >> PGD_PAGES_SHIFT])
+				return true;
+			cnt = PGD_PAGES;
+		} else if (!(idx & (PMD_PAGES - 1)) && num >= PMD_PAGES) {
+			if (pmd_private_cnt[idx >> PMD_PAGES_SHIFT])
+				return true;
+			cnt = PMD_PAGES;
+		} else {
+			cnt = PMD_PAGES - (idx & (PMD_PAGES - 1));
+			if (cnt > num)
+				cnt = num;
+			if (pmd_private_cnt[idx >> PMD_PAGES_SHIFT] &&
+			    scan_private(idx, cnt))
+				return true;
+		}
+		idx += cnt;
+		num -= cnt;
+	}
+
+	return false;
+}
+
+// set the pages selected by mask in *meta, return the change of private pages
+static inline int64_t fill_meta(page_meta_t *meta, page_meta_t mask,
+				page_meta_t pattern)
+{
+	int64_t delta = count_pages(private_pages(pattern) & mask) -
+			count_pages(private_pages(*meta) & mask);
+	*meta	      = (*meta & ~mask) | (pattern & mask);
+	return delta;
+}
+
+// fill [idx, idx + num) of the bitmap with the metadata pattern
+static void fill_range(uint64_t idx, uint64_t num, page_meta_t pattern)
+{
+	while (num) {
+		uint64_t pmd   = idx >> PMD_PAGES_SHIFT;
+		uint64_t first = idx & (PMD_PAGES - 1);
+		uint64_t cnt   = PMD_PAGES - first;
+		int64_t delta  = 0;
+		if (cnt > num)
+			cnt = num;
+
+		if (cnt == PMD_PAGES) {
+			// a whole 2MB region, the counter is the old value
+			page_meta_t *meta = &bitmap[pmd * PMD_METAS];
+			for (uint64_t i = 0; i < PMD_METAS; i++)
+				meta[i] = pattern;
+			delta = (pattern == PRIVATE_PAGE ? (int64_t)PMD_PAGES : 0) -
+				(int64_t)pmd_private_cnt[pmd];
+		} else {
+			page_meta_t *meta = &bitmap[idx >> PAGES_PER_META_SHIFT];
+			uint64_t off	  = idx & (PAGES_PER_META - 1);
+			uint64_t left	  = cnt;
+			while (left) {
+				uint64_t n = PAGES_PER_META - off;
+				if (n > left)
+					n = left;
+				delta += fill_meta(meta, meta_mask(off, n),
+						   pattern);
+				meta++;
+				left -= n;
+				off = 0;
+			}
+		}
+
+		pmd_private_cnt[pmd] += delta;
+		pgd_private_cnt[idx >> PGD_PAGES_SHIFT] += delta;
+		idx += cnt;
+		num -= cnt;
+	}
+}
+
 // returns 1 if contains private page, otherwise 0
 int contain_private_range(uint64_t pfn_start, uint64_t num)
 {
 	check_input_and_update_pfn_start(pfn_start, num);
 
-	page_meta_t *meta = &bitmap[pfn_start];
-	uintptr_t cur	  = 0;
-	while (cur < num) {
-		if (IS_PRIVATE_PAGE(*meta))
-			return 1;
-		meta += 1;
-		cur += 1;
-	}
-
-	return 0;
+	return find_private(pfn_start, num) ? 1 : 0;
 }
 
 // returns 0 if there exists page that is not public or shared, otherwise 1
@@ -81,16 +247,7 @@ int test_public_shared_range(uintptr_t pfn_start, uintptr_t num)
 {
 	check_input_and_update_pfn_start(pfn_start, num);
 
-	page_meta_t *meta = &bitmap[pfn_start];
-	uintptr_t cur	  = 0;
-	while (cur < num) {
-		if (!IS_PUBLIC_OR_SHARED_PAGE(*meta))
-			return 0;
-		meta += 1;
-		cur += 1;
-	}
-
-	return 1;
+	return find_private(pfn_start, num) ? 0 : 1;
 }
 
 // sets range to be private page
@@ -98,13 +255,7 @@ int set_private_range(uint64_t pfn_start, uint64_t num)
 {
 	check_input_and_update_pfn_start(pfn_start, num);
 
-	page_meta_t *meta = &bitmap[pfn_start];
-	uintptr_t cur	  = 0;
-	while (cur < num) {
-		*meta = PRIVATE_PAGE;
-		meta += 1;
-		cur += 1;
-	}
+	fill_range(pfn_start, num, PRIVATE_PAGE);
 
 	return 0;
 }
@@ -114,13 +265,7 @@ int set_public_range(uint64_t pfn_start, uint64_t num)
 {
 	check_input_and_update_pfn_start(pfn_start, num);
 
-	page_meta_t *meta = &bitmap[pfn_start];
-	uintptr_t cur	  = 0;
-	while (cur < num) {
-		*meta = PUBLIC_PAGE;
-		meta += 1;
-		cur += 1;
-	}
+	fill_range(pfn_start, num, PUBLIC_PAGE);
 
 	return 0;
 }
@@ -130,13 +275,7 @@ int set_shared_range(uint64_t pfn_start, uint64_t num)
 {
 	check_input_and_update_pfn_start(pfn_start, num);
 
-	page_meta_t *meta = &bitmap[pfn_start];
-	uintptr_t cur	  = 0;
-	while (cur < num) {
-		*meta = SHARED_PAGE;
-		meta += 1;
-		cur += 1;
-	}
+	fill_range(pfn_start, num, SHARED_PAGE);
 
 	return 0;
 }
@@ -4,6 +4,11 @@
 #include <sbi/riscv_asm.h>
 #include <sbi/sbi_console.h>
 #include <sbi/sbi_string.h>
+#include <sbi/sbi_hartmask.h>
+#include <sbi/sbi_platform.h>
+#include <sbi/sbi_scratch.h>
+#include <sbi/sbi_tlb.h>
+#include <sbi/riscv_locks.h>
 
 static bool reverse_map_initialized = false;
 
@@ -22,54 +27,387 @@ inline bool is_leaf_pte(uint64_t pte)
 	return (pte & PTE_R) || (pte & PTE_W) || (pte & PTE_X);
 }
 
+extern uintptr_t hpt_start, hpt_pmd_start, hpt_pte_start, hpt_end;
+
 #ifdef CONFIG_SBI_ECALL_SM_REVERSE_MAP
+/*
+ * One node per valid leaf PTE in HPT Area, recording the extent
+ * [pfn, pfn + (1 << shift)) it maps. Leaves are naturally aligned, so the
+ * nodes are hashed by (shift, pfn >> shift): the PTEs overlapping a pfn range
+ * are found by probing each level for the aligned blocks the range touches.
+ * The chains are doubly linked and every HPT Area slot points at its node,
+ * so deleting the node of a PTE does not walk the chain.
+ */
 struct ReverseMap {
 	uintptr_t *pte;
+	uintptr_t pfn;
+	uintptr_t shift;
 	struct ReverseMap *nxt;
+	struct ReverseMap **pprev;
 };
-struct ReverseMap **reverse_map, **reverse_map_end;
+struct ReverseMap **reverse_map;
+static uintptr_t reverse_map_hash_bits;
+static struct ReverseMap **reverse_map_by_pte;
 struct ReverseMap *reverse_map_empty_head;
+static spinlock_t reverse_map_pool_lock = SPIN_LOCK_INITIALIZER;
+
+/*
+ * Free nodes are cached per hart, so that allocating and freeing a node
+ * only touches hart-local data. The caches are refilled from and drained to
+ * the global free list (reverse_map_empty_head) in batches.
+ */
+#define REVERSE_MAP_CACHE_BATCH 32
+#define REVERSE_MAP_CACHE_MAX (2 * REVERSE_MAP_CACHE_BATCH)
+
+struct ReverseMapCache {
+	struct ReverseMap *head;
+	uintptr_t count;
+};
+static unsigned long reverse_map_cache_off;
+
+static const uintptr_t reverse_map_shifts[] = { 0, 9, 18 };
+
+static inline uintptr_t page_num_to_shift(uintptr_t page_num)
+{
+	return page_num == 1 ? 0 : (page_num == 512 ? 9 : 18);
+}
+
+static inline struct ReverseMap **reverse_map_bucket(uintptr_t block,
+						     uintptr_t shift)
+{
+	uint64_t key = block ^ ((uint64_t)shift << 56);
+	return &reverse_map[(key * 0x9E3779B97F4A7C15ULL) >>
+			    (64 - reverse_map_hash_bits)];
+}
+
+static inline struct ReverseMap **reverse_map_slot(uintptr_t *pte_addr)
+{
+	return &reverse_map_by_pte[((uintptr_t)pte_addr - hpt_start) /
+				   sizeof(uintptr_t)];
+}
 
+static inline struct ReverseMapCache *reverse_map_cache(void)
+{
+	return sbi_scratch_thishart_offset_ptr(reverse_map_cache_off);
+}
+
+static struct ReverseMap *alloc_reverse_map_node(void)
+{
+	struct ReverseMapCache *cache = reverse_map_cache();
+	struct ReverseMap *node;
+
+	if (!cache->head) {
+		spin_lock(&reverse_map_pool_lock);
+		while (reverse_map_empty_head &&
+		       cache->count < REVERSE_MAP_CACHE_BATCH) {
+			node		       = reverse_map_empty_head;
+			reverse_map_empty_head = node->nxt;
+			node->nxt	       = cache->head;
+			cache->head	       = node;
+			cache->count++;
+		}
+		spin_unlock(&reverse_map_pool_lock);
+		if (!cache->head)
+			return NULL;
+	}
+
+	node	    = cache->head;
+	cache->head = node->nxt;
+	cache->count--;
+	return node;
+}
+
+static inline void free_reverse_map_node(struct ReverseMap *node)
+{
+	struct ReverseMapCache *cache = reverse_map_cache();
+
+	node->pte   = NULL;
+	node->pprev = NULL;
+	node->nxt   = cache->head;
+	cache->head = node;
+	if (++cache->count <= REVERSE_MAP_CACHE_MAX)
+		return;
+
+	spin_lock(&reverse_map_pool_lock);
+	while (cache->count > REVERSE_MAP_CACHE_BATCH) {
+		node		       = cache->head;
+		cache->head	       = node->nxt;
+		node->nxt	       = reverse_map_empty_head;
+		reverse_map_empty_head = node;
+		cache->count--;
+	}
+	spin_unlock(&reverse_map_pool_lock);
+}
+
+static inline void unlink_reverse_map_node(struct ReverseMap *node)
+{
+	*node->pprev = node->nxt;
+	if (node->nxt)
+		node->nxt->pprev = node->pprev;
+	*reverse_map_slot(node->pte) = NULL;
+	free_reverse_map_node(node);
+}
 #endif
 
+/*
+ * Per 4KB page of HPT Area. parent and links record the entry that links a
+ * page-table page into the tree, so that the host virtual address of its
+ * entries can be recovered when unmap_range invalidates them. parent is NULL
+ * when the page is not linked or is linked at different addresses.
+ *
+ * Without the reverse map, unmap_range has to scan HPT Area. To skip the
+ * page-table pages that cannot map the range, every page also keeps the
+ * number of its valid leaf entries and the pfn bounds they map. The bounds
+ * only grow until the page has no valid leaf left.
+ */
+struct HptPage {
+	uintptr_t *parent;
+	uintptr_t links;
+#ifndef CONFIG_SBI_ECALL_SM_REVERSE_MAP
+	uint64_t leaves;
+	uint64_t pfn_min;
+	uint64_t pfn_end;
+#endif
+};
+static struct HptPage *hpt_pages;
+
+static inline uint64_t hpt_pages_size(void)
+{
+	return ((hpt_end - hpt_start) >> PAGE_SHIFT) * sizeof(struct HptPage);
+}
+
+static inline struct HptPage *hpt_page_of(uintptr_t *pte_addr)
+{
+	return &hpt_pages[((uintptr_t)pte_addr - hpt_start) >> PAGE_SHIFT];
+}
+
+// log2 of the memory size mapped by an entry of HPT Area
+static inline uintptr_t hpt_entry_shift(uintptr_t pte_addr)
+{
+	if (pte_addr < hpt_pmd_start)
+		return PAGE_SHIFT + 18;
+	if (pte_addr < hpt_pte_start)
+		return PAGE_SHIFT + 9;
+	return PAGE_SHIFT;
+}
+
+// the non-leaf entry at pte_addr now points to the table of pte
+static void link_page_table(uintptr_t *pte_addr, uintptr_t pte)
+{
+	uintptr_t child = pte_to_pfn(pte) << PAGE_SHIFT;
+	bool from_pgd	= (uintptr_t)pte_addr < hpt_pmd_start;
+
+	// a PGD entry links a PMD page, a PMD entry links a PTE page
+	if (from_pgd ? (child < hpt_pmd_start || child >= hpt_pte_start)
+		     : (child < hpt_pte_start || child >= hpt_end))
+		return;
+
+	struct HptPage *page = hpt_page_of((uintptr_t *)child);
+	if (!page->links++) {
+		page->parent = pte_addr;
+		return;
+	}
+	/*
+	 * Shared tables (e.g. kernel mappings) are fine as long as every
+	 * link gives the same address: PGD entries at the same index.
+	 */
+	if (page->parent &&
+	    !(from_pgd && (uintptr_t)page->parent < hpt_pmd_start &&
+	      (((uintptr_t)page->parent ^ (uintptr_t)pte_addr) &
+	       (PAGE_SIZE - 1)) == 0))
+		page->parent = NULL;
+}
+
+// the non-leaf entry at pte_addr no longer points to the table of pte
+static void unlink_page_table(uintptr_t *pte_addr, uintptr_t pte)
+{
+	uintptr_t child = pte_to_pfn(pte) << PAGE_SHIFT;
+	bool from_pgd	= (uintptr_t)pte_addr < hpt_pmd_start;
+
+	if (from_pgd ? (child < hpt_pmd_start || child >= hpt_pte_start)
+		     : (child < hpt_pte_start || child >= hpt_end))
+		return;
+
+	struct HptPage *page = hpt_page_of((uintptr_t *)child);
+	if (page->links && !--page->links)
+		page->parent = NULL;
+}
+
+// host virtual address mapped by the first entry of a page-table page
+static bool hpt_page_va(uintptr_t pt, uintptr_t *va)
+{
+	if (pt < hpt_pmd_start) {
+		*va = 0;
+		return true;
+	}
+	uintptr_t parent = (uintptr_t)hpt_page_of((uintptr_t *)pt)->parent;
+	if (!parent || !hpt_page_va(parent & ~(PAGE_SIZE - 1), va))
+		return false;
+	*va += ((parent & (PAGE_SIZE - 1)) / sizeof(uintptr_t))
+	       << hpt_entry_shift(parent);
+	return true;
+}
+
+// host virtual address mapped by an entry of HPT Area (Sv39)
+static bool hpt_entry_va(uintptr_t *pte_addr, uintptr_t *va)
+{
+	uintptr_t addr = (uintptr_t)pte_addr;
+	if (!hpt_pages || !hpt_page_va(addr & ~(PAGE_SIZE - 1), va))
+		return false;
+	*va += ((addr & (PAGE_SIZE - 1)) / sizeof(uintptr_t))
+	       << hpt_entry_shift(addr);
+	if (*va & (1UL << 38))
+		*va |= ~((1UL << 39) - 1);
+	return true;
+}
+
+/*
+ * Host virtual ranges whose leaf PTEs were invalidated by unmap_range on
+ * this hart and still need a remote sfence.vma. They are collapsed into one
+ * bounding range so that unmap_flush_batch costs a single IPI round.
+ */
+struct UnmapBatch {
+	uintptr_t start;
+	uintptr_t end;
+	bool pending;
+	bool flush_all;
+} __cacheline_aligned;
+static struct UnmapBatch unmap_batches[SBI_HARTMASK_MAX_BITS];
+
+static void unmap_batch_add(uintptr_t *pte_addr)
+{
+	struct UnmapBatch *batch = &unmap_batches[current_hartid()];
+	uintptr_t va;
+
+	if (!hpt_entry_va(pte_addr, &va)) {
+		batch->flush_all = true;
+	} else {
+		uintptr_t end = va + (1UL << hpt_entry_shift((uintptr_t)pte_addr));
+		if (!batch->pending || va < batch->start)
+			batch->start = va;
+		if (!batch->pending || end > batch->end)
+			batch->end = end;
+	}
+	batch->pending = true;
+}
+
+int unmap_flush_batch(void)
+{
+	struct UnmapBatch *batch = &unmap_batches[current_hartid()];
+	struct sbi_tlb_info tinfo;
+	unsigned long start, size;
+
+	if (!batch->pending)
+		return 0;
+
+	start = batch->start;
+	size  = batch->end - batch->start;
+	if (batch->flush_all ||
+	    size > sbi_platform_tlbr_flush_limit(sbi_platform_thishart_ptr())) {
+		start = 0;
+		size  = SBI_TLB_FLUSH_ALL;
+	}
+	batch->pending	 = false;
+	batch->flush_all = false;
+
+	SBI_TLB_INFO_INIT(&tinfo, start, size, 0, 0, sbi_tlb_local_sfence_vma,
+			  current_hartid());
+	return sbi_tlb_request(0, -1UL, &tinfo);
+}
+
 int init_reverse_map(uintptr_t reverse_map_base, uint64_t reverse_map_size,
 		     uint64_t dummy_head_size)
 {
 #ifdef CONFIG_SBI_ECALL_SM_REVERSE_MAP
+	// the number of hash buckets is rounded down to a power of 2
+	uintptr_t buckets     = dummy_head_size / sizeof(struct ReverseMap *);
+	reverse_map_hash_bits = 0;
+	while (((uintptr_t)2 << reverse_map_hash_bits) <= buckets)
+		reverse_map_hash_bits++;
+	if (unlikely(!reverse_map_hash_bits)) {
+		sbi_printf("M mode: %s : invalid dummy head size 0x%lx\n",
+			   __func__, dummy_head_size);
+		return -1;
+	}
+
+	// [hash buckets][one node pointer per HPT Area slot][hpt_pages][nodes]
+	uint64_t index_size = hpt_end - hpt_start;
+	if (unlikely(dummy_head_size + index_size + hpt_pages_size() >=
+		     reverse_map_size)) {
+		sbi_printf("M mode: %s : reverse map size 0x%lx is too small\n",
+			   __func__, reverse_map_size);
+		return -1;
+	}
+
+	if (!reverse_map_cache_off) {
+		reverse_map_cache_off =
+			sbi_scratch_alloc_offset(sizeof(struct ReverseMapCache));
+		if (!reverse_map_cache_off) {
+			sbi_printf("M mode: %s : no scratch space for the node cache\n",
+				   __func__);
+			return -1;
+		}
+	}
+	for (u32 i = 0; i <= sbi_scratch_last_hartid(); i++) {
+		struct sbi_scratch *rscratch = sbi_hartid_to_scratch(i);
+		if (rscratch)
+			sbi_memset(sbi_scratch_offset_ptr(rscratch,
+							  reverse_map_cache_off),
+				   0, sizeof(struct ReverseMapCache));
+	}
+
 	reverse_map = (struct ReverseMap **)reverse_map_base;
 	sbi_memset((void *)reverse_map_base, 0, dummy_head_size);
-	uintptr_t nodes_base   = reverse_map_base + dummy_head_size;
-	reverse_map_end	       = (struct ReverseMap **)nodes_base;
-	reverse_map_empty_head = (struct ReverseMap *)nodes_base;
+	reverse_map_by_pte =
+		(struct ReverseMap **)(reverse_map_base + dummy_head_size);
+	sbi_memset(reverse_map_by_pte, 0, index_size);
+	hpt_pages = (struct HptPage *)(reverse_map_base + dummy_head_size +
+				       index_size);
+	sbi_memset(hpt_pages, 0, hpt_pages_size());
+	uintptr_t nodes_base   = (uintptr_t)hpt_pages + hpt_pages_size();
+	reverse_map_empty_head = NULL;
 	uintptr_t node_end     = reverse_map_base + reverse_map_size;
-	uintptr_t cnt	       = 0;
-	for (struct ReverseMap *node = (struct ReverseMap *)nodes_base;
-	     node < (struct ReverseMap *)node_end; node++) {
-		cnt++;
-		node->pte = 0;
-		node->nxt = (node + 1) < (struct ReverseMap *)node_end
-				    ? (node + 1)
-				    : NULL;
+	for (struct ReverseMap *node = (struct ReverseMap *)node_end - 1;
+	     node >= (struct ReverseMap *)nodes_base; node--) {
+		node->pte	       = NULL;
+		node->pprev	       = NULL;
+		node->nxt	       = reverse_map_empty_head;
+		reverse_map_empty_head = node;
 	}
+#else
+	if (unlikely(hpt_pages_size() > reverse_map_size)) {
+		sbi_printf("M mode: %s : reverse map size 0x%lx is too small\n",
+			   __func__, reverse_map_size);
+		return -1;
+	}
+	hpt_pages = (struct HptPage *)reverse_map_base;
+	sbi_memset(hpt_pages, 0, hpt_pages_size());
 #endif
 	reverse_map_initialized = true;
 	return 0;
 }
 
-extern uintptr_t hpt_start, hpt_pmd_start, hpt_pte_start, hpt_end;
 int set_up_reverse_map_from_hpt_area()
 {
-#ifdef CONFIG_SBI_ECALL_SM_REVERSE_MAP
+	if (hpt_pages == NULL)
+		return 0;
+#ifndef CONFIG_SBI_ECALL_SM_REVERSE_MAP
+	sbi_memset(hpt_pages, 0, hpt_pages_size());
+#endif
 	// pgd -> 1GB(512 * 512 pages), pmd -> 2MB(512 pages), pte -> 4KB(1 page)
 	for (uintptr_t *pgd = (uintptr_t *)hpt_start;
 	     pgd < (uintptr_t *)hpt_pmd_start; pgd++) {
-		if (pte_valid(*pgd) && is_leaf_pte(*pgd))
+		if (pte_valid(*pgd) && !is_leaf_pte(*pgd))
+			link_page_table(pgd, *pgd);
+		else if (pte_valid(*pgd))
 			if (add_reverse_map(*pgd, pgd, 512 * 512))
 				return -1;
 	}
 	for (uintptr_t *pmd = (uintptr_t *)hpt_pmd_start;
 	     pmd < (uintptr_t *)hpt_pte_start; pmd++) {
-		if (pte_valid(*pmd) && is_leaf_pte(*pmd))
+		if (pte_valid(*pmd) && !is_leaf_pte(*pmd))
+			link_page_table(pmd, *pmd);
+		else if (pte_valid(*pmd))
 			if (add_reverse_map(*pmd, pmd, 512))
 				return -1;
 	}
@@ -79,25 +417,45 @@ int set_up_reverse_map_from_hpt_area()
 			if (add_reverse_map(*pte, pte, 1))
 				return -1;
 	}
-#endif
 	return 0;
 }
 
 int add_reverse_map(uintptr_t pte, uintptr_t *pte_addr, uintptr_t page_num)
 {
 #ifdef CONFIG_SBI_ECALL_SM_REVERSE_MAP
-	uintptr_t start = pte_to_pfn(pte) - ((uint64_t)DRAM_BASE >> PAGE_SHIFT);
-	uintptr_t end	= start + page_num;
-	for (uintptr_t i = start; i < end; i++) {
-		if (reverse_map_empty_head == NULL) {
-			sbi_printf("M mode: reverse_map_empty_head is NULL\n");
-			return -1;
-		}
-		struct ReverseMap *cur = reverse_map_empty_head;
-		reverse_map_empty_head = cur->nxt;
-		cur->nxt	       = reverse_map[i];
-		cur->pte	       = pte_addr;
-		reverse_map[i]	       = cur;
+	struct ReverseMap **slot = reverse_map_slot(pte_addr);
+	if (*slot != NULL)
+		unlink_reverse_map_node(*slot);
+	struct ReverseMap *cur = alloc_reverse_map_node();
+	if (cur == NULL) {
+		sbi_printf("M mode: reverse_map_empty_head is NULL\n");
+		return -1;
+	}
+	uintptr_t shift		= page_num_to_shift(page_num);
+	uintptr_t pfn		= pte_to_pfn(pte);
+	struct ReverseMap **head = reverse_map_bucket(pfn >> shift, shift);
+	cur->pte		= pte_addr;
+	cur->pfn		= pfn;
+	cur->shift		= shift;
+	cur->nxt		= *head;
+	cur->pprev		= head;
+	if (*head)
+		(*head)->pprev = &cur->nxt;
+	*head = cur;
+	*slot = cur;
+#else
+	if (hpt_pages == NULL)
+		return 0;
+	struct HptPage *occ = hpt_page_of(pte_addr);
+	uint64_t pfn	    = pte_to_pfn(pte);
+	if (!occ->leaves++) {
+		occ->pfn_min = pfn;
+		occ->pfn_end = pfn + page_num;
+	} else {
+		if (pfn < occ->pfn_min)
+			occ->pfn_min = pfn;
+		if (pfn + page_num > occ->pfn_end)
+			occ->pfn_end = pfn + page_num;
 	}
 #endif
 	return 0;
@@ -106,23 +464,15 @@ int add_reverse_map(uintptr_t pte, uintptr_t *pte_addr, uintptr_t page_num)
 int delete_reverse_map(uintptr_t pte, uintptr_t *pte_addr, uintptr_t page_num)
 {
 #ifdef CONFIG_SBI_ECALL_SM_REVERSE_MAP
-	uintptr_t start = pte_to_pfn(pte) - ((uint64_t)DRAM_BASE >> PAGE_SHIFT);
-	uintptr_t end	= start + page_num;
-	for (uintptr_t i = start; i < end; i++) {
-		struct ReverseMap **prev = &reverse_map[i];
-		struct ReverseMap *cur	 = reverse_map[i];
-		while (cur != NULL) {
-			if (cur->pte == pte_addr) {
-				*prev		       = cur->nxt;
-				cur->nxt	       = reverse_map_empty_head;
-				reverse_map_empty_head = cur;
-				break;
-			} else {
-				prev = &cur->nxt;
-				cur  = cur->nxt;
-			}
-		}
-	}
+	struct ReverseMap *cur = *reverse_map_slot(pte_addr);
+	if (cur != NULL)
+		unlink_reverse_map_node(cur);
+#else
+	if (hpt_pages == NULL)
+		return 0;
+	struct HptPage *occ = hpt_page_of(pte_addr);
+	if (occ->leaves)
+		occ->leaves--;
 #endif
 	return 0;
 }
@@ -146,65 +496,58 @@ int unmap_range(uint64_t pfn_start, uint64_t num)
 			   __func__);
 		return -1;
 	}
+	if (unlikely(!num))
+		return 0;
 
 #ifdef CONFIG_SBI_ECALL_SM_REVERSE_MAP
-	uint64_t idx_start = pfn_start - ((uint64_t)DRAM_BASE >> PAGE_SHIFT);
-	uint64_t idx_end   = idx_start + num;
-	struct ReverseMap *cur, *nxt;
-	for (uintptr_t i = idx_start; i < idx_end; i++) {
-		cur = NULL;
-		nxt = reverse_map[i];
-		while (nxt != NULL) {
-			cur = nxt;
-			// uintptr_t pfn = pte_to_pfn(*cur->pte);
-			// int page_num = 1;
-			// check_huge_pt((uintptr_t)cur->pte, *cur->pte, &page_num);
-			// if(pfn + page_num > pfn_base && pfn < pfn_end)
-			// {
-			if (pte_valid(*cur->pte))
-				*cur->pte ^= PTE_V;
-			// } else {
-			//   sbi_printf("M mode: unmap_mm_region: invalid pte\n");
-			//   sbi_printf("  pfn 0x%lx, page_num 0x%x, pfn_base 0x%lx, pfn_end 0x%lx, is_leaf_pte %d\n", pfn, page_num, pfn_base, pfn_end, is_leaf_pte(*cur->pte));
-			//   sbi_printf("  i 0x%lx, cur 0x%lx, pte address 0x%lx, pte value 0x%lx\n", i, (uintptr_t)cur, (uintptr_t)cur->pte, *cur->pte);
-			//   return -1;
-			// }
-			nxt = cur->nxt;
-		}
-		if (cur) {
-			cur->nxt	       = reverse_map_empty_head;
-			reverse_map_empty_head = reverse_map[i];
-			reverse_map[i]	       = NULL;
+	uint64_t pfn_base = pfn_start + ((uint64_t)DRAM_BASE >> PAGE_SHIFT);
+	uint64_t pfn_last = pfn_base + num - 1;
+	for (int l = 0; l < array_size(reverse_map_shifts); l++) {
+		uintptr_t shift = reverse_map_shifts[l];
+		for (uint64_t blk = pfn_base >> shift; blk <= pfn_last >> shift;
+		     blk++) {
+			struct ReverseMap **prev = reverse_map_bucket(blk, shift);
+			struct ReverseMap *cur	 = *prev;
+			while (cur != NULL) {
+				if (cur->shift != shift ||
+				    (cur->pfn >> shift) != blk) {
+					prev = &cur->nxt;
+					cur  = cur->nxt;
+					continue;
+				}
+				// the PTE is invalid from now on, drop its node
+				if (pte_valid(*cur->pte)) {
+					*cur->pte ^= PTE_V;
+					unmap_batch_add(cur->pte);
+				}
+				unlink_reverse_map_node(cur);
+				cur = *prev;
+			}
 		}
 	}
 #else
-	uint64_t pfn_end = pfn_start + num;
+	uint64_t pfn_base = pfn_start + ((uint64_t)DRAM_BASE >> PAGE_SHIFT);
+	uint64_t pfn_end  = pfn_base + num;
 
-	// unmap PMD
-	for (uint64_t *pte = (uint64_t *)hpt_pmd_start;
-	     pte < (uint64_t *)hpt_pte_start; pte++) {
-		if (!(*pte & PTE_V))
+	// only scan the page-table pages whose leaves may overlap the range
+	for (uintptr_t pt = hpt_start; pt < hpt_end; pt += PAGE_SIZE) {
+		struct HptPage *occ = hpt_page_of((uintptr_t *)pt);
+		if (!occ->leaves || occ->pfn_end <= pfn_base ||
+		    occ->pfn_min >= pfn_end)
 			continue;
-		uint64_t pfn = pte_to_pfn(*pte);
-		if ((*pte & PTE_R) || (*pte & PTE_W) ||
-		    (*pte & PTE_X)) { // is leaf
-			if (!(pfn_end < pfn ||
-			      pfn + 512 < pfn_start)) { // overlap
+		uint64_t page_num = get_page_num(pt);
+		for (uint64_t *pte = (uint64_t *)pt;
+		     pte < (uint64_t *)(pt + PAGE_SIZE); pte++) {
+			if (!pte_valid(*pte) || !is_leaf_pte(*pte))
+				continue;
+			uint64_t pfn = pte_to_pfn(*pte);
+			if (pfn < pfn_end && pfn + page_num > pfn_base) {
 				*pte = *pte ^ PTE_V;
+				occ->leaves--;
+				unmap_batch_add(pte);
 			}
 		}
 	}
-
-	// unmap PTE
-	for (uint64_t *pte = (uint64_t *)hpt_pte_start;
-	     pte < (uint64_t *)hpt_end; pte++) {
-		if (!(*pte & PTE_V))
-			continue;
-		uint64_t pfn = pte_to_pfn(*pte);
-		if (pfn_start <= pfn && pfn < pfn_end) { // overlap
-			*pte = *pte ^ PTE_V;
-		}
-	}
 #endif
 
 	return 0;
@@ -212,7 +555,6 @@ int unmap_range(uint64_t pfn_start, uint64_t num)
 
 int set_single_pte(uint64_t *addr, uint64_t pte, size_t page_num)
 {
-#ifdef CONFIG_SBI_ECALL_SM_REVERSE_MAP
 	// delete the old reverse map
 	uintptr_t old_pte_src = *addr;
 	if (pte_valid(old_pte_src)) {
@@ -221,26 +563,29 @@ int set_single_pte(uint64_t *addr, uint64_t pte, size_t page_num)
 			sbi_printf("M mode: set_single_pte: get_page_num failed\n");
 			return -1;
 		}
-		if (delete_reverse_map(old_pte_src, addr, old_page_num) <
-		    0) {
+		if (!is_leaf_pte(old_pte_src)) {
+			if (hpt_pages)
+				unlink_page_table(addr, old_pte_src);
+		} else if (delete_reverse_map(old_pte_src, addr,
+					      old_page_num) < 0) {
 			sbi_printf("M mode: set_single_pte: delete_reverse_map failed\n");
 			return -1;
 		}
 	}
-#endif
 
 	// update pte
 	*((uint64_t *)addr) = pte;
 
-#ifdef CONFIG_SBI_ECALL_SM_REVERSE_MAP
 	// create the new reverse map
-	if (page_num && is_leaf_pte(pte)) {
+	if (pte_valid(pte) && !is_leaf_pte(pte)) {
+		if (hpt_pages)
+			link_page_table(addr, pte);
+	} else if (page_num && pte_valid(pte)) {
 		if (add_reverse_map(pte, addr, page_num) < 0) {
 			sbi_printf("M mode: set_single_pte: add_reverse_map failed\n");
 			return -1;
 		}
 	}
-#endif
 
 	return 0;
 }
@@ -8,6 +8,7 @@
 #include <sbi/sbi_unpriv.h>
 #include <sbi/sbi_error.h>
 #include <sbi/sbi_hart.h>
+#include <sbi/sbi_ipi.h>
 #include <sbi/riscv_locks.h>
 #include <sbi/riscv_asm.h>
 #include <sbi/riscv_encoding.h>
@@ -15,6 +16,9 @@
 #include <sbi/sbi_pmp.h>
 #include <sbi/sbi_tvm.h>
 #include <sbi/sbi_math.h>
+#include <sbi/sbi_hartmask.h>
+#include <sbi/riscv_atomic.h>
+#include <sbi/riscv_barrier.h>
 
 // TODO: more levels
 #include <sbi/sbi_bitops.h>
@@ -74,11 +78,33 @@ static const struct insn_match csr_functions[] = {
 	// },
 };
 
-#define STORED_STATES 16
-#define VM_BUCKETS 16
+/*
+ * vCPU registry. The states are carved out of per-VM arenas in SM memory
+ * (the .bss, covered by the PMP entry of sm_init) and indexed by an
+ * open-addressed table keyed by (VMID, vCPU id). Lookups are lock free,
+ * creating and destroying take the lock of the VM's stripe, and
+ * vcpu_slots_lock while they change the table.
+ */
+#define VCPU_ARENA_STATES 8
+#define VCPU_ARENAS 32
+#define VCPU_SLOTS_BITS 9
+#define VCPU_SLOTS (1UL << VCPU_SLOTS_BITS)
+#define VCPU_LOCKS 16
+#define VCPU_SLOT_DELETED 1L
+// set in vcpu_state.run_page while the page is accessed
+#define RUN_PAGE_BUSY 1L
+
+struct vcpu_arena {
+	atomic_t owner;	    // VMID + 1, 0 if the arena is free
+	unsigned long used; // allocated states, under the VM's stripe lock
+	struct vcpu_state states[VCPU_ARENA_STATES];
+};
 
-static struct vcpu_state states[VM_BUCKETS][STORED_STATES];
-static spinlock_t global_lock = SPIN_LOCK_INITIALIZER;
+static struct vcpu_arena vcpu_arenas[VCPU_ARENAS];
+// struct vcpu_state *, 0 if empty, VCPU_SLOT_DELETED if deleted
+static atomic_t vcpu_slots[VCPU_SLOTS];
+static spinlock_t vcpu_locks[VCPU_LOCKS];
+static spinlock_t vcpu_slots_lock = SPIN_LOCK_INITIALIZER;
 inline uintptr_t pte_to_ppn(uintptr_t pte)
 {
 	return pte >> PTE_PPN_SHIFT;
@@ -94,10 +120,59 @@ void update_min_usable_pmp_id(unsigned int pmp_idx)
 	next_pmp_idx = pmp_idx;
 }
 
+// the memory hidden from the host by PMP: the SM, bitmap, HPT Area, reverse map
+#define SM_REGIONS 4
+static struct {
+	uintptr_t start, end;
+} sm_regions[SM_REGIONS];
+static int sm_region_count;
+
+// sm_init runs on every hart, a region is only recorded once
+static int protect_region(uintptr_t start, unsigned long log2len)
+{
+	int r = set_pmp_and_sync(next_pmp_idx++, 0, start, log2len);
+	if (r)
+		return r;
+	for (int i = 0; i < sm_region_count; i++) {
+		if (sm_regions[i].start == start)
+			return 0;
+	}
+	if (sm_region_count < SM_REGIONS) {
+		sm_regions[sm_region_count].start = start;
+		sm_regions[sm_region_count].end	  = start + (1UL << log2len);
+		sm_region_count++;
+	}
+	return 0;
+}
+
+static bool in_sm_region(uintptr_t start, uintptr_t end)
+{
+	for (int i = 0; i < sm_region_count; i++) {
+		if (start < sm_regions[i].end && sm_regions[i].start < end)
+			return true;
+	}
+	return false;
+}
+
+static void sm_vcpu_ipi_process(struct sbi_scratch *scratch);
+
+static struct sbi_ipi_event_ops sm_vcpu_ipi_ops = {
+	.name	 = "IPI_SM_VCPU",
+	.process = sm_vcpu_ipi_process,
+};
+
+static int sm_vcpu_ipi_event = -1;
+static spinlock_t sm_init_lock = SPIN_LOCK_INITIALIZER;
+
 void sm_init()
 {
-	if (set_pmp_and_sync(
-		    next_pmp_idx++, 0, 0x80000000,
+	spin_lock(&sm_init_lock);
+	if (sm_vcpu_ipi_event < 0)
+		sm_vcpu_ipi_event = sbi_ipi_event_create(&sm_vcpu_ipi_ops);
+	spin_unlock(&sm_init_lock);
+
+	if (protect_region(
+		    0x80000000,
 		    log2roundup(0x200000))) { // TODO: check the size of SM
 		sbi_panic("Unable to use PMP to protect SM\n");
 	}
@@ -133,8 +208,7 @@ int bitmap_and_hpt_init(uintptr_t bitmap_start, uint64_t bitmap_size,
 		return r;
 	}
 
-	r = set_pmp_and_sync(next_pmp_idx++, 0, bitmap_start,
-			     log2roundup(bitmap_size));
+	r = protect_region(bitmap_start, log2roundup(bitmap_size));
 	if (r) {
 		sbi_printf(
 			"bitmap_and_hpt_init: PMP for bitmap init failed (error %d)\n",
@@ -142,8 +216,7 @@ int bitmap_and_hpt_init(uintptr_t bitmap_start, uint64_t bitmap_size,
 		return r;
 	}
 
-	r = set_pmp_and_sync(next_pmp_idx++, 0, hpt_start,
-			     log2roundup(hpt_size));
+	r = protect_region(hpt_start, log2roundup(hpt_size));
 	if (r) {
 		sbi_printf(
 			"bitmap_and_hpt_init: PMP for HPT Area init failed (error %d)\n",
@@ -171,16 +244,13 @@ int sm_reverse_map_init(uintptr_t reverse_map_start, uint64_t reverse_map_size)
 		return r;
 	}
 
-#ifdef CONFIG_SBI_ECALL_SM_REVERSE_MAP
-	r = set_pmp_and_sync(next_pmp_idx++, 0, reverse_map_start,
-			     log2roundup(reverse_map_size));
+	r = protect_region(reverse_map_start, log2roundup(reverse_map_size));
 	if (r) {
 		sbi_printf(
 			"bitmap_and_hpt_init: PMP for reverse map init failed (error %d)\n",
 			r);
 		return r;
 	}
-#endif
 
 	return 0;
 }
@@ -234,6 +304,180 @@ int monitor_init(uintptr_t *mstatus)
 	return 0;
 }
 
+/*
+ * Per-hart cache of G-stage translations, a small software TLB in front of
+ * gpa_to_hpa. An entry either maps a leaf (the PTE of `level` that covers
+ * the GPA) or a table (the page table indexed by the VPN of `level` for
+ * all GPAs sharing the upper VPNs), so a walk that misses the leaf can
+ * still resume below the root. Entries are tagged with the whole hgatp,
+ * which holds the VMID, and are dropped by sm_gpa_cache_flush() on
+ * hfence.gvma and by sm_gpa_cache_set_hgatp() when a VMID gets a new root.
+ */
+#define GPA_CACHE_SETS 4
+#define GPA_CACHE_WAYS 4
+#define GPA_CACHE_LEAF 1UL
+#define GPA_CACHE_LEVEL_SHIFT 1
+#define GPA_CACHE_TAG_SHIFT 4
+
+struct gpa_cache_entry {
+	uintptr_t hgatp; // 0 if the entry is invalid
+	uintptr_t key;
+	uintptr_t ppn;
+};
+
+struct gpa_cache {
+	struct gpa_cache_entry entries[GPA_CACHE_SETS][GPA_CACHE_WAYS];
+	u8 victim[GPA_CACHE_SETS];
+} __cacheline_aligned;
+
+static struct gpa_cache gpa_caches[SBI_HARTMASK_MAX_BITS];
+
+static inline uintptr_t hgatp_vmid(uintptr_t hgatp)
+{
+	return (hgatp & HGATP_VMID_MASK) >> HGATP_VMID_SHIFT;
+}
+
+static inline uintptr_t gpa_cache_key(uintptr_t gpa, unsigned shift,
+				      unsigned level, bool leaf)
+{
+	return ((gpa >> shift) << GPA_CACHE_TAG_SHIFT) |
+	       (level << GPA_CACHE_LEVEL_SHIFT) | (leaf ? GPA_CACHE_LEAF : 0);
+}
+
+static inline unsigned gpa_cache_set(uintptr_t key)
+{
+	return (key ^ (key >> GPA_CACHE_TAG_SHIFT)) & (GPA_CACHE_SETS - 1);
+}
+
+static struct gpa_cache_entry *gpa_cache_lookup(struct gpa_cache *cache,
+						uintptr_t hgatp, uintptr_t key)
+{
+	struct gpa_cache_entry *set = cache->entries[gpa_cache_set(key)];
+	for (int i = 0; i < GPA_CACHE_WAYS; i++) {
+		if (set[i].key == key && set[i].hgatp == hgatp)
+			return &set[i];
+	}
+	return NULL;
+}
+
+static void gpa_cache_insert(struct gpa_cache *cache, uintptr_t hgatp,
+			     uintptr_t key, uintptr_t ppn)
+{
+	unsigned idx			= gpa_cache_set(key);
+	struct gpa_cache_entry *entry	= &cache->entries[idx][cache->victim[idx]];
+	cache->victim[idx]		= (cache->victim[idx] + 1) % GPA_CACHE_WAYS;
+	entry->hgatp			= hgatp;
+	entry->key			= key;
+	entry->ppn			= ppn;
+}
+
+void sm_gpa_cache_flush(unsigned long vmid, bool all)
+{
+	struct gpa_cache *cache = &gpa_caches[current_hartid()];
+	for (int i = 0; i < GPA_CACHE_SETS; i++) {
+		for (int j = 0; j < GPA_CACHE_WAYS; j++) {
+			struct gpa_cache_entry *entry = &cache->entries[i][j];
+			if (all || hgatp_vmid(entry->hgatp) == vmid)
+				entry->hgatp = 0;
+		}
+	}
+}
+
+void sm_gpa_cache_set_hgatp(unsigned long hgatp)
+{
+	struct gpa_cache *cache = &gpa_caches[current_hartid()];
+	unsigned long vmid	= hgatp_vmid(hgatp);
+	for (int i = 0; i < GPA_CACHE_SETS; i++) {
+		for (int j = 0; j < GPA_CACHE_WAYS; j++) {
+			struct gpa_cache_entry *entry = &cache->entries[i][j];
+			if (entry->hgatp != hgatp &&
+			    hgatp_vmid(entry->hgatp) == vmid)
+				entry->hgatp = 0;
+		}
+	}
+}
+
+struct g_stage_format {
+	uintptr_t mode;
+	uintptr_t root_ppn;
+	unsigned levels, pte_size, vpn_len;
+};
+
+// decode the translation mode of hgatp, returns -1 for Bare/unsupported
+static int g_stage_format(uintptr_t hgatp, struct g_stage_format *fmt)
+{
+#if __riscv_xlen == 32
+	fmt->mode     = hgatp >> HGATP32_MODE_SHIFT;
+	fmt->root_ppn = hgatp & HGATP32_PPN;
+#else
+	fmt->mode     = hgatp >> HGATP64_MODE_SHIFT;
+	fmt->root_ppn = hgatp & HGATP64_PPN;
+#endif
+	if (unlikely(fmt->mode == 0)) { // Bare
+		sbi_printf("%s: G-stage translation is Bare\n", __func__);
+		return -1;
+	} else if (unlikely(fmt->mode == 1)) { // Sv32x4
+		fmt->pte_size = 4;
+		fmt->levels   = 2;
+		fmt->vpn_len  = 10;
+	} else if (8 <= fmt->mode &&
+		   fmt->mode <= 10) { // Sv39x4, Sv48x4, Sv57x4
+		// WARNING: Sv57x4's GPA formats are inconsistent in riscv-privileged-20211203
+		fmt->pte_size = 8;
+		fmt->levels   = fmt->mode - 8 + 3;
+		fmt->vpn_len  = 9;
+	} else {
+		sbi_printf("%s: Unsupported HGATP mode: %ld\n", __func__,
+			   fmt->mode);
+		return -1;
+	}
+	return 0;
+}
+
+static inline unsigned g_stage_shift(const struct g_stage_format *fmt,
+				     int level)
+{
+	return level * fmt->vpn_len + PAGE_SHIFT;
+}
+
+// read the entry of gpa in the page table of the level
+static inline uintptr_t g_stage_read_pte(const struct g_stage_format *fmt,
+					 uintptr_t table_ppn, int level,
+					 uintptr_t gpa)
+{
+	uintptr_t vpn = gpa >> g_stage_shift(fmt, level);
+	if (level != fmt->levels - 1)
+		vpn &= (1 << fmt->vpn_len) - 1;
+	uintptr_t addr = table_ppn * PAGE_SIZE + fmt->pte_size * vpn;
+	if (unlikely(fmt->mode == 1))
+		return *(uint32_t *)addr;
+	return *(uint64_t *)addr;
+}
+
+static inline bool g_stage_is_leaf(uintptr_t pte)
+{
+	return pte & (PTE_R | PTE_W | PTE_X);
+}
+
+// the deepest cached page table on the path of gpa, the root if none
+static int gpa_cache_find_table(struct gpa_cache *cache, uintptr_t hgatp,
+				const struct g_stage_format *fmt,
+				uintptr_t gpa, uintptr_t *table_ppn)
+{
+	int top = fmt->levels - 1;
+	for (int i = 0; i < top; i++) {
+		struct gpa_cache_entry *entry = gpa_cache_lookup(
+			cache, hgatp,
+			gpa_cache_key(gpa, g_stage_shift(fmt, i + 1), i, false));
+		if (entry) {
+			*table_ppn = entry->ppn;
+			return i;
+		}
+	}
+	*table_ppn = fmt->root_ppn;
+	return top;
+}
+
 /**
  * @brief translate guest physical address to host physical address by HGATP
  *
@@ -244,88 +488,232 @@ int monitor_init(uintptr_t *mstatus)
 inline static uintptr_t gpa_to_hpa(uintptr_t gpa, uintptr_t *size)
 {
 	const uintptr_t hgatp = csr_read(CSR_HGATP);
-#if __riscv_xlen == 32
-	const uintptr_t hgatp_mode = hgatp >> HGATP32_MODE_SHIFT;
-	uintptr_t page_table_ppn   = hgatp & HGATP32_PPN;
-#else
-	const uintptr_t hgatp_mode = hgatp >> HGATP64_MODE_SHIFT;
-	uintptr_t page_table_ppn   = hgatp & HGATP64_PPN;
-#endif
-	unsigned ppn_num, pte_size, vpn_len;
-	if (unlikely(hgatp_mode == 0)) { // Bare
-		ppn_num = 0;
-	} else if (unlikely(hgatp_mode == 1)) { // Sv32x4
-		pte_size = 4;
-		ppn_num	 = 2;
-		vpn_len	 = 10;
-	} else if (8 <= hgatp_mode &&
-		   hgatp_mode <= 10) { // Sv39x4, Sv48x4, Sv57x4
-		// WARNING: Sv57x4's GPA formats are inconsistent in riscv-privileged-20211203
-		pte_size = 8;
-		ppn_num	 = hgatp_mode - 8 + 3;
-		vpn_len	 = 9;
-	} else {
-		sbi_printf("gpa_to_hpa: Unsupported HGATP mode: %ld\n",
-			   hgatp_mode);
+	struct g_stage_format fmt;
+	if (g_stage_format(hgatp, &fmt))
 		return 0;
-	}
-	for (int i = ppn_num - 1; i >= 0; i--) {
-		uintptr_t pte;
-		uintptr_t vpn = gpa >> (i * vpn_len + 12);
-		if (i != ppn_num - 1)
-			vpn &= (1 << vpn_len) - 1;
-		uintptr_t offset = pte_size * vpn;
-		if (unlikely(hgatp_mode == 1)) {
-			uint32_t tmp =
-				*(uint32_t *)(page_table_ppn * PAGE_SIZE +
-					      offset);
-			pte = tmp;
-		} else {
-			uint64_t tmp =
-				*(uint64_t *)(page_table_ppn * PAGE_SIZE +
-					      offset);
-			pte = tmp;
+
+	struct gpa_cache *cache = &gpa_caches[current_hartid()];
+	// a cached leaf of any level, then the deepest cached table
+	for (int i = 0; i < fmt.levels; i++) {
+		unsigned shift = g_stage_shift(&fmt, i);
+		struct gpa_cache_entry *entry = gpa_cache_lookup(
+			cache, hgatp, gpa_cache_key(gpa, shift, i, true));
+		if (entry) {
+			*size = 1UL << shift;
+			return (entry->ppn << PAGE_SHIFT) + (gpa & (*size - 1));
 		}
+	}
+	uintptr_t page_table_ppn;
+	int level = gpa_cache_find_table(cache, hgatp, &fmt, gpa,
+					 &page_table_ppn);
+
+	for (int i = level; i >= 0; i--) {
+		uintptr_t pte = g_stage_read_pte(&fmt, page_table_ppn, i, gpa);
+		unsigned shift = g_stage_shift(&fmt, i);
 		if (unlikely(!(pte & PTE_V))) {
 			sbi_printf("gpa_to_hpa: Invalid PTE: 0x%lx\n", pte);
 			return 0;
 		}
-		if (pte & PTE_R || pte & PTE_W || pte & PTE_X) {
-			*size = 1 << (i * vpn_len + 12);
+		if (g_stage_is_leaf(pte)) {
+			gpa_cache_insert(cache, hgatp,
+					 gpa_cache_key(gpa, shift, i, true),
+					 pte_to_ppn(pte));
+			*size = 1UL << shift;
 			return pte_to_phys(pte) + (gpa & (*size - 1));
 		} else {
 			page_table_ppn = pte_to_ppn(pte);
+			if (i > 0)
+				gpa_cache_insert(
+					cache, hgatp,
+					gpa_cache_key(gpa, shift, i - 1, false),
+					page_table_ppn);
 		}
 	}
 	sbi_printf("gpa_to_hpa: levels more than expected: 0xgpa %lx\n", gpa);
 	return 0;
 }
 
+#define G_STAGE_LEVELS_MAX 5
+
+// pass the pages overlapping [hpa, hpa + size) to fn
+static inline int g_stage_extent(int (*fn)(uint64_t pfn_start, uint64_t num),
+				 uintptr_t hpa, uint64_t size)
+{
+	uint64_t pfn_start = hpa >> PAGE_SHIFT;
+	uint64_t pfn_end   = (hpa + size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	return fn(pfn_start, pfn_end - pfn_start);
+}
+
+/**
+ * @brief call fn for every host physically contiguous extent of a guest
+ * physical range, in a single descent of the G-stage table
+ *
+ * The page table of every level is kept between leaves, so the walk only
+ * reads the levels whose index changes. Adjacent leaves that are also
+ * contiguous in host physical memory are merged before fn is called.
+ *
+ * @param gpa guest physical address of the start of the range
+ * @param size size of the range
+ * @param fn called with the first host pfn and the number of pages of each
+ *           extent, e.g. set_shared_range
+ * @return 0 on success, -1 if the range is not mapped or fn failed
+ */
+static int gpa_range_for_each_extent(uintptr_t gpa, uint64_t size,
+				     int (*fn)(uint64_t pfn_start,
+					       uint64_t num))
+{
+	const uintptr_t hgatp = csr_read(CSR_HGATP);
+	struct g_stage_format fmt;
+	if (g_stage_format(hgatp, &fmt))
+		return -1;
+
+	// table[i] is the table of level i for the GPAs whose upper VPNs are
+	// table_tag[i], -1UL never matches
+	uintptr_t table[G_STAGE_LEVELS_MAX];
+	uintptr_t table_tag[G_STAGE_LEVELS_MAX];
+	for (int i = 0; i < G_STAGE_LEVELS_MAX; i++)
+		table_tag[i] = -1UL;
+	int top	   = fmt.levels - 1;
+	int loaded = gpa_cache_find_table(&gpa_caches[current_hartid()], hgatp,
+					  &fmt, gpa, &table[top]);
+	if (loaded != top) {
+		table[loaded]	  = table[top];
+		table_tag[loaded] = gpa >> g_stage_shift(&fmt, loaded + 1);
+		table[top]	  = fmt.root_ppn;
+	}
+
+	uintptr_t ext_hpa = 0, ext_size = 0;
+	while (size) {
+		// resume from the deepest table that still covers gpa
+		int level = top;
+		for (int i = loaded; i < top; i++) {
+			if (table_tag[i] == gpa >> g_stage_shift(&fmt, i + 1)) {
+				level = i;
+				break;
+			}
+		}
+
+		uintptr_t pte;
+		for (;; level--) {
+			pte = g_stage_read_pte(&fmt, table[level], level, gpa);
+			if (unlikely(!(pte & PTE_V))) {
+				sbi_printf("%s: Invalid PTE: 0x%lx (gpa 0x%lx)\n",
+					   __func__, pte, gpa);
+				return -1;
+			}
+			if (g_stage_is_leaf(pte))
+				break;
+			if (unlikely(level == 0)) {
+				sbi_printf("%s: levels more than expected: 0xgpa %lx\n",
+					   __func__, gpa);
+				return -1;
+			}
+			table[level - 1]     = pte_to_ppn(pte);
+			table_tag[level - 1] = gpa >> g_stage_shift(&fmt, level);
+		}
+		loaded = level;
+
+		uintptr_t mask = (1UL << g_stage_shift(&fmt, level)) - 1;
+		uintptr_t hpa  = pte_to_phys(pte) + (gpa & mask);
+		uint64_t len   = mask + 1 - (gpa & mask);
+		if (len > size)
+			len = size;
+
+		if (ext_size && ext_hpa + ext_size == hpa) {
+			ext_size += len;
+		} else {
+			if (ext_size && g_stage_extent(fn, ext_hpa, ext_size))
+				return -1;
+			ext_hpa	 = hpa;
+			ext_size = len;
+		}
+		gpa += len;
+		size -= len;
+	}
+	if (ext_size && g_stage_extent(fn, ext_hpa, ext_size))
+		return -1;
+
+	return 0;
+}
+
 int sm_set_bounce_buffer(uintptr_t gpaddr_start, uint64_t size)
 {
 	sbi_printf(
 		"SM is trying to set bounce buffer as shared memory(gpa=0x%lx, size=0x%lx)\n",
 		gpaddr_start, size);
-	uintptr_t mapping_size;
 	lock_bitmap;
-	while (size) {
-		uintptr_t hpaddr_start =
-			gpa_to_hpa(gpaddr_start, &mapping_size);
-		if (hpaddr_start == 0) {
-			sbi_printf("sm_set_bounce_buffer: gpa_to_hpa failed\n");
-			return -1;
+	int ret = gpa_range_for_each_extent(gpaddr_start, size,
+					    set_shared_range);
+	unlock_bitmap;
+	if (unlikely(ret)) {
+		sbi_printf("sm_set_bounce_buffer: failed (gpa=0x%lx, size=0x%lx)\n",
+			   gpaddr_start, size);
+		return -1;
+	}
+	sbi_printf("sm_set_bounce_buffer finished successfully\n");
+	return 0;
+}
+
+/*
+ * Unregister the run pages in [pfn_start, pfn_start + num), waiting for the
+ * HARTs that are accessing one of them. The caller holds the bitmap lock.
+ */
+static void revoke_run_pages(uint64_t pfn_start, uint64_t num)
+{
+	for (int i = 0; i < VCPU_ARENAS; i++) {
+		for (int j = 0; j < VCPU_ARENA_STATES; j++) {
+			atomic_t *run_page = &vcpu_arenas[i].states[j].run_page;
+			long page;
+			while ((page = atomic_read(run_page))) {
+				uint64_t pfn = (unsigned long)page >> PAGE_SHIFT;
+				if (pfn < pfn_start || pfn >= pfn_start + num)
+					break;
+				if (!(page & RUN_PAGE_BUSY) &&
+				    atomic_cmpxchg(run_page, page, 0) == page)
+					break;
+			}
 		}
-		int ret = set_shared_range(hpaddr_start >> PAGE_SHIFT,
-					   mapping_size >> PAGE_SHIFT);
-		if (unlikely(ret))
-			sbi_printf(
-				"sm_set_shared(gpa: 0x%lx, hpa: 0x%lx, 0x%lx) errno: %d\n",
-				gpaddr_start, hpaddr_start, mapping_size, ret);
-		gpaddr_start += mapping_size;
-		size -= mapping_size;
 	}
+}
+
+// the host may not map private pages, drop its mappings first
+static int set_private_extent(uint64_t pfn_start, uint64_t num)
+{
+	if (in_sm_region(pfn_start << PAGE_SHIFT,
+			 (pfn_start + num) << PAGE_SHIFT))
+		return -1;
+	if (unmap_range(pfn_start, num))
+		return -1;
+	revoke_run_pages(pfn_start, num);
+	return set_private_range(pfn_start, num);
+}
+
+// an extent set_private_extent accepts: in the bitmap, not SM memory
+static int check_private_extent(uint64_t pfn_start, uint64_t num)
+{
+	if (in_sm_region(pfn_start << PAGE_SHIFT,
+			 (pfn_start + num) << PAGE_SHIFT))
+		return -1;
+	return test_public_shared_range(pfn_start, num) < 0 ? -1 : 0;
+}
+
+int sm_set_private_memory(uintptr_t gpaddr_start, uint64_t size)
+{
+	lock_bitmap;
+	// check every extent first, so that a failure converts nothing
+	int ret = gpa_range_for_each_extent(gpaddr_start, size,
+					    check_private_extent);
+	if (likely(!ret))
+		ret = gpa_range_for_each_extent(gpaddr_start, size,
+						set_private_extent);
 	unlock_bitmap;
-	sbi_printf("sm_set_bounce_buffer finished successfully\n");
+	// one shootdown for all the extents, also when a later one failed
+	unmap_flush_batch();
+	if (unlikely(ret)) {
+		sbi_printf("sm_set_private_memory: failed (gpa=0x%lx, size=0x%lx)\n",
+			   gpaddr_start, size);
+		return -1;
+	}
 	return 0;
 }
 
@@ -336,9 +724,10 @@ uint64_t get_vm_id()
 	return (hgatp & HGATP64_VMID_MASK) >> HGATP_VMID_SHIFT;
 }
 
+// keep only the VMID in hgatp while the host runs, one csrrw
 static void mask_hgatp(struct vcpu_state *state) {
-	state->hgatp = csr_read(CSR_HGATP);
-	csr_write(CSR_HGATP, state->hgatp & HGATP64_VMID_MASK);
+	state->hgatp = csr_swap(CSR_HGATP, (state->vm_id << HGATP_VMID_SHIFT) &
+						   HGATP_VMID_MASK);
 }
 
 static void restore_hgatp(struct vcpu_state *state) {
@@ -346,101 +735,413 @@ static void restore_hgatp(struct vcpu_state *state) {
 	state->hgatp = 0;
 }
 
+static inline spinlock_t *vm_lock(unsigned long vm_id)
+{
+	return &vcpu_locks[vm_id % VCPU_LOCKS];
+}
+
+static inline unsigned long vcpu_slot_hash(unsigned long vm_id,
+					   uint64_t cpu_id)
+{
+	uint64_t key = ((uint64_t)vm_id << 32) ^ cpu_id;
+	return (key * 0x9E3779B97F4A7C15ULL) >> (64 - VCPU_SLOTS_BITS);
+}
+
 struct vcpu_state *get_vcpu_state(unsigned long vm_id, uint64_t cpu_id)
 {
-	// TODO: make this handle "conflicts" properly
-	return &states[vm_id % VM_BUCKETS][cpu_id];
+	unsigned long idx = vcpu_slot_hash(vm_id, cpu_id);
+	for (unsigned long i = 0; i < VCPU_SLOTS; i++) {
+		long slot = vcpu_slots[(idx + i) & (VCPU_SLOTS - 1)].counter;
+		if (!slot)
+			break;
+		struct vcpu_state *state = (struct vcpu_state *)slot;
+		if (slot != VCPU_SLOT_DELETED && state->vm_id == vm_id &&
+		    state->cpu_id == cpu_id)
+			return state;
+	}
+	return NULL;
 }
 
-static inline void prepare_for_vm(struct sbi_trap_regs *regs,
-				  struct vcpu_state *state)
+// publish a new state in the registry, the caller holds the VM's lock
+static int insert_vcpu_state(struct vcpu_state *state)
 {
-	regs->mstatus &= ~MSTATUS_TSR;
+	unsigned long idx = vcpu_slot_hash(state->vm_id, state->cpu_id);
+	int ret		  = -1;
+
+	spin_lock(&vcpu_slots_lock);
+	for (unsigned long i = 0; i < VCPU_SLOTS; i++) {
+		atomic_t *slot = &vcpu_slots[(idx + i) & (VCPU_SLOTS - 1)];
+		long old       = slot->counter;
+		if (old == 0 || old == VCPU_SLOT_DELETED) {
+			// the state is complete before lookups can find it
+			smp_wmb();
+			atomic_write(slot, (long)state);
+			ret = 0;
+			break;
+		}
+	}
+	spin_unlock(&vcpu_slots_lock);
 
-	regs->extraInfo = 1;
+	return ret;
+}
+
+/*
+ * A deleted slot followed by an empty one ends every probe sequence that
+ * reaches it, so it is emptied, and so are the tombstones before it.
+ * Otherwise lookups that miss would scan more and more of the table.
+ */
+static void delete_vcpu_state(struct vcpu_state *state)
+{
+	unsigned long idx = vcpu_slot_hash(state->vm_id, state->cpu_id);
+
+	spin_lock(&vcpu_slots_lock);
+	for (unsigned long i = 0; i < VCPU_SLOTS; i++) {
+		unsigned long pos = (idx + i) & (VCPU_SLOTS - 1);
+		if (vcpu_slots[pos].counter != (long)state)
+			continue;
+		if (vcpu_slots[(pos + 1) & (VCPU_SLOTS - 1)].counter) {
+			atomic_write(&vcpu_slots[pos], VCPU_SLOT_DELETED);
+			break;
+		}
+		do {
+			atomic_write(&vcpu_slots[pos], 0);
+			pos = (pos - 1) & (VCPU_SLOTS - 1);
+		} while (vcpu_slots[pos].counter == VCPU_SLOT_DELETED);
+		break;
+	}
+	spin_unlock(&vcpu_slots_lock);
+}
 
-	ulong deleg = csr_read(CSR_MIDELEG);
-	csr_write(CSR_MIDELEG, deleg & ~(MIP_SSIP | MIP_STIP | MIP_SEIP));
+// take a state from an arena of the VM, the caller holds the VM's lock
+static struct vcpu_state *alloc_vcpu_state(unsigned long vm_id)
+{
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < VCPU_ARENAS; i++) {
+			struct vcpu_arena *arena = &vcpu_arenas[i];
+			// first the arenas of the VM, then claim a free one
+			if (pass && atomic_cmpxchg(&arena->owner, 0, vm_id + 1))
+				continue;
+			if (atomic_read(&arena->owner) != vm_id + 1 ||
+			    arena->used == (1UL << VCPU_ARENA_STATES) - 1)
+				continue;
+			for (int j = 0; j < VCPU_ARENA_STATES; j++) {
+				if (!(arena->used & (1UL << j))) {
+					arena->used |= 1UL << j;
+					return &arena->states[j];
+				}
+			}
+		}
+	}
+	return NULL;
+}
 
-	ulong exception = csr_read(CSR_MEDELEG);
-	csr_write(CSR_MEDELEG, 0);
+/*
+ * MMIO windows declared by the guests, a sorted table per VM. Guest page
+ * faults inside a window are emulated in a single exit. The tables are
+ * updated under the VM's lock and read without it: seq is odd while a
+ * table is updated, readers retry when it changed under them.
+ */
+#define MMIO_WINDOWS 8
 
-	state->prev_exception = exception;
+struct mmio_window {
+	uintptr_t start, end;
+};
 
-	restore_hgatp(state);
+struct vm_mmio {
+	atomic_t owner; // VMID + 1, 0 if free
+	atomic_t seq;
+	unsigned long count;
+	struct mmio_window windows[MMIO_WINDOWS];
+};
 
-	return;
+static struct vm_mmio vm_mmios[VCPU_ARENAS];
+
+static inline void vm_mmio_write_begin(struct vm_mmio *mmio)
+{
+	atomic_add_return(&mmio->seq, 1);
 }
 
-static inline void restore_registers(struct sbi_trap_regs *regs,
-				     struct vcpu_state *state)
+static inline void vm_mmio_write_end(struct vm_mmio *mmio)
 {
-	ulong orig_insn = state->trap.tval;
-	ulong reg_value = 0;
+	atomic_add_return(&mmio->seq, 1);
+}
+
+// the MMIO table of the VM, the caller holds the VM's lock
+static struct vm_mmio *find_vm_mmio(unsigned long vm_id, bool create)
+{
+	for (int i = 0; i < VCPU_ARENAS; i++) {
+		if (atomic_read(&vm_mmios[i].owner) == vm_id + 1)
+			return &vm_mmios[i];
+	}
+	if (!create)
+		return NULL;
+	for (int i = 0; i < VCPU_ARENAS; i++) {
+		if (!atomic_cmpxchg(&vm_mmios[i].owner, 0, vm_id + 1)) {
+			vm_mmio_write_begin(&vm_mmios[i]);
+			vm_mmios[i].count = 0;
+			vm_mmio_write_end(&vm_mmios[i]);
+			return &vm_mmios[i];
+		}
+	}
+	return NULL;
+}
 
-	if (state->was_csr_insn) {
-		reg_value = *REG_PTR(orig_insn, SH_RD, regs);
+int sm_register_mmio(uintptr_t gpa, uint64_t size)
+{
+	unsigned long vm_id = get_vm_id();
+	uintptr_t end	    = gpa + size;
+	if (!size || end < gpa) {
+		sbi_printf("M mode: %s : invalid window 0x%lx, 0x%lx\n",
+			   __func__, gpa, size);
+		return -1;
 	}
 
-	ulong epc     = regs->mepc;
-	ulong status  = regs->mstatus;
-	ulong statusH = regs->mstatusH;
+	spin_lock(vm_lock(vm_id));
+
+	struct vm_mmio *mmio = find_vm_mmio(vm_id, true);
+	if (!mmio || mmio->count == MMIO_WINDOWS) {
+		spin_unlock(vm_lock(vm_id));
+		sbi_printf("M mode: %s : no free MMIO window\n", __func__);
+		return -1;
+	}
 
-	sbi_memcpy(regs, &state->vcpu_state, sizeof(struct sbi_trap_regs));
+	unsigned long pos = 0;
+	while (pos < mmio->count && mmio->windows[pos].start < gpa)
+		pos++;
+	if ((pos > 0 && mmio->windows[pos - 1].end > gpa) ||
+	    (pos < mmio->count && mmio->windows[pos].start < end)) {
+		spin_unlock(vm_lock(vm_id));
+		sbi_printf("M mode: %s : window 0x%lx, 0x%lx overlaps\n",
+			   __func__, gpa, size);
+		return -1;
+	}
+	vm_mmio_write_begin(mmio);
+	for (unsigned long i = mmio->count; i > pos; i--)
+		mmio->windows[i] = mmio->windows[i - 1];
+	mmio->windows[pos].start = gpa;
+	mmio->windows[pos].end	 = end;
+	mmio->count++;
+	vm_mmio_write_end(mmio);
+
+	spin_unlock(vm_lock(vm_id));
+	return 0;
+}
 
-	regs->mepc     = epc;
-	regs->mstatus  = status;
-	regs->mstatusH = statusH;
+// lock free, called on every guest load/store page fault
+static bool is_mmio_gpa(unsigned long vm_id, uintptr_t gpa)
+{
+	struct vm_mmio *mmio = NULL;
+	bool found;
+	long seq;
 
-	if (state->was_csr_insn) {
-		SET_RD(orig_insn, regs, reg_value);
+	for (int i = 0; i < VCPU_ARENAS; i++) {
+		if (atomic_read(&vm_mmios[i].owner) == vm_id + 1) {
+			mmio = &vm_mmios[i];
+			break;
+		}
 	}
+	if (!mmio)
+		return false;
+
+	do {
+		while ((seq = atomic_read(&mmio->seq)) & 1)
+			;
+		// the table was released, and maybe reused, since it was found
+		if (atomic_read(&mmio->owner) != vm_id + 1)
+			return false;
+
+		found		 = false;
+		unsigned long lo = 0, hi = mmio->count;
+		if (hi > MMIO_WINDOWS)
+			hi = MMIO_WINDOWS;
+		while (lo < hi) {
+			unsigned long mid = (lo + hi) / 2;
+			if (gpa < mmio->windows[mid].start)
+				hi = mid;
+			else if (gpa >= mmio->windows[mid].end)
+				lo = mid + 1;
+			else {
+				found = true;
+				break;
+			}
+		}
+		smp_rmb();
+	} while (atomic_read(&mmio->seq) != seq);
 
-	return;
+	return found;
 }
 
-inline void restore_registers_ecall(struct sbi_trap_regs *regs, struct vcpu_state *state)
+// move an idle vCPU to VCPU_EXITING, so it cannot be resumed meanwhile
+static inline bool claim_vcpu(struct vcpu_state *state)
 {
-	ulong epc     = regs->mepc;
-	ulong status  = regs->mstatus;
-	ulong statusH = regs->mstatusH;
-	ulong a0 = regs->a0;
-	ulong a1 = regs->a1;
-	ulong a2 = regs->a2;
-	ulong a3 = regs->a3;
-	ulong a4 = regs->a4;
-	ulong a5 = regs->a5;
-	ulong a6 = regs->a6;
-	ulong a7 = regs->a7;
+	return atomic_cmpxchg(&state->status, VCPU_IDLE, VCPU_EXITING) ==
+	       VCPU_IDLE;
+}
 
-	sbi_memcpy(regs, &state->vcpu_state, sizeof(struct sbi_trap_regs));
+static inline void release_vcpu(struct vcpu_state *state)
+{
+	atomic_write(&state->status, VCPU_IDLE);
+}
 
-	regs->mepc     = epc;
-	regs->mstatus  = status;
-	regs->mstatusH = statusH;
+// release the vCPUs of the VM claimed before states[end_state] of arena end
+static void release_vm_vcpus(unsigned long vm_id, int end, int end_state)
+{
+	for (int i = 0; i <= end && i < VCPU_ARENAS; i++) {
+		struct vcpu_arena *arena = &vcpu_arenas[i];
+		if (atomic_read(&arena->owner) != vm_id + 1)
+			continue;
+		for (int j = 0; j < VCPU_ARENA_STATES; j++) {
+			if (i == end && j == end_state)
+				return;
+			if (arena->used & (1UL << j))
+				release_vcpu(&arena->states[j]);
+		}
+	}
+}
+
+int sm_destroy_vm(unsigned long vm_id)
+{
+	spin_lock(vm_lock(vm_id));
+
+	// claim every vCPU, a running one fails the destruction
+	for (int i = 0; i < VCPU_ARENAS; i++) {
+		struct vcpu_arena *arena = &vcpu_arenas[i];
+		if (atomic_read(&arena->owner) != vm_id + 1)
+			continue;
+		for (int j = 0; j < VCPU_ARENA_STATES; j++) {
+			if ((arena->used & (1UL << j)) &&
+			    !claim_vcpu(&arena->states[j])) {
+				release_vm_vcpus(vm_id, i, j);
+				spin_unlock(vm_lock(vm_id));
+				sbi_printf("M mode: %s : vCPU %ld of VM %ld is running\n",
+					   __func__, arena->states[j].cpu_id,
+					   vm_id);
+				return -1;
+			}
+		}
+	}
+
+	for (int i = 0; i < VCPU_ARENAS; i++) {
+		struct vcpu_arena *arena = &vcpu_arenas[i];
+		if (atomic_read(&arena->owner) != vm_id + 1)
+			continue;
+		for (int j = 0; j < VCPU_ARENA_STATES; j++) {
+			if (arena->used & (1UL << j))
+				delete_vcpu_state(&arena->states[j]);
+		}
+		arena->used = 0;
+		atomic_write(&arena->owner, 0);
+	}
+
+	// emptied before it is released, a reader may still hold it
+	struct vm_mmio *mmio = find_vm_mmio(vm_id, false);
+	if (mmio) {
+		vm_mmio_write_begin(mmio);
+		mmio->count = 0;
+		vm_mmio_write_end(mmio);
+		atomic_write(&mmio->owner, 0);
+	}
 
-	regs->a0 = a0; 
-	regs->a1 = a1; 
-	regs->a2 = a2; 
-	regs->a3 = a3; 
-	regs->a4 = a4; 
-	regs->a5 = a5; 
-	regs->a6 = a6; 
-	regs->a7 = a7;
+	spin_unlock(vm_lock(vm_id));
+	return 0;
+}
+
+// interrupts that stay in M mode while a vCPU runs
+#define VM_MIDELEG_CLEAR (MIP_SSIP | MIP_STIP | MIP_SEIP)
+
+// write the delegation CSRs whose shadow differs from the target
+static inline void set_delegation(struct sm_world_switch *ws, ulong mideleg,
+				  ulong medeleg)
+{
+	if (ws->mideleg != mideleg) {
+		csr_write(CSR_MIDELEG, mideleg);
+		ws->mideleg = mideleg;
+	}
+	if (ws->medeleg != medeleg) {
+		csr_write(CSR_MEDELEG, medeleg);
+		ws->medeleg = medeleg;
+	}
+}
+
+static inline void prepare_for_vm(struct sbi_trap_regs *regs,
+				  struct vcpu_state *state)
+{
+	struct sm_world_switch *ws = &sbi_scratch_thishart_ptr()->world_switch;
+
+	regs->mstatus &= ~MSTATUS_TSR;
+
+	regs->extraInfo = 1;
+
+	set_delegation(ws, ws->host_mideleg & ~VM_MIDELEG_CLEAR, 0);
+
+	restore_hgatp(state);
 
 	return;
 }
 
+/*
+ * The world switch moves the GPRs word by word and skips the registers
+ * that the exit cause exposes to the host, given as a mask of GPR numbers.
+ * mepc/mstatus/mstatusH always stay those of the trap frame.
+ */
+#define SM_GPRS 32
+#define GPR_BIT(insn, pos) (1U << (((insn) >> (pos)) & 0x1f))
+#define GPR_A0_A7 (0xffU << 10)
+
+static inline void copy_gprs(struct sbi_trap_regs *dst,
+			     const struct sbi_trap_regs *src, u32 skip)
+{
+	unsigned long *d       = (unsigned long *)dst;
+	const unsigned long *s = (const unsigned long *)src;
+	for (int i = 0; i < SM_GPRS; i += 4) {
+		if (!(skip & (1U << i)))
+			d[i] = s[i];
+		if (!(skip & (2U << i)))
+			d[i + 1] = s[i + 1];
+		if (!(skip & (4U << i)))
+			d[i + 2] = s[i + 2];
+		if (!(skip & (8U << i)))
+			d[i + 3] = s[i + 3];
+	}
+}
+
+static inline void clear_gprs(struct sbi_trap_regs *regs, u32 keep)
+{
+	unsigned long *r = (unsigned long *)regs;
+	for (int i = 0; i < SM_GPRS; i += 4) {
+		if (!(keep & (1U << i)))
+			r[i] = 0;
+		if (!(keep & (2U << i)))
+			r[i + 1] = 0;
+		if (!(keep & (4U << i)))
+			r[i + 2] = 0;
+		if (!(keep & (8U << i)))
+			r[i + 3] = 0;
+	}
+	regs->extraInfo = 0;
+}
+
+static inline void restore_registers(struct sbi_trap_regs *regs,
+				     struct vcpu_state *state)
+{
+	// the host emulated the CSR read, its rd is the result
+	ulong orig_insn = state->trap.tval;
+	u32 skip	= state->was_csr_insn ? GPR_BIT(orig_insn, SH_RD) : 0;
+
+	copy_gprs(regs, &state->vcpu_state, skip);
+}
+
+static inline void restore_registers_ecall(struct sbi_trap_regs *regs, struct vcpu_state *state)
+{
+	// a0-a7 carry the result of the SBI call from the host
+	copy_gprs(regs, &state->vcpu_state, GPR_A0_A7);
+}
+
 static inline void restore_registers_mmio_load(struct sbi_trap_regs *regs,
 				     struct vcpu_state *state)
 {
-	ulong htinst = csr_read(CSR_HTINST);
 	ulong insn = state->prev_mmio_insn;
 
-	if (htinst & 0x1) {
-		insn = htinst | INSN_16BIT_MASK;
-	}
-
 	/* Decode length of MMIO and shift */
 	if ((insn & INSN_MASK_LW) == INSN_MATCH_LW) {
 		// Pass
@@ -455,66 +1156,69 @@ static inline void restore_registers_mmio_load(struct sbi_trap_regs *regs,
 	}
 	
 
-	ulong epc     = regs->mepc;
-	ulong status  = regs->mstatus;
-	ulong statusH = regs->mstatusH;
-	ulong saved_value = *REG_PTR(insn, SH_RD, regs);
-
-	sbi_memcpy(regs, &state->vcpu_state, sizeof(struct sbi_trap_regs));
-
-	regs->mepc     = epc;
-	regs->mstatus  = status;
-	regs->mstatusH = statusH;
-
-	SET_RD(insn, regs, saved_value);
-
-	return;
+	// rd holds the value the host loaded
+	copy_gprs(regs, &state->vcpu_state, GPR_BIT(insn, SH_RD));
 }
 
 
-struct vcpu_state *sm_prepare_cpu(uint64_t cpu_id)
+// make the vCPU taken by sm_resume_cpu the one running on this hart
+static inline void sm_prepare_cpu(struct vcpu_state *state)
 {
-	if (cpu_id >= STORED_STATES) {
-		return 0;
-	}
-
-	unsigned long vm_id = get_vm_id();
-
 	struct sbi_scratch *scratch = sbi_scratch_thishart_ptr();
 
-	scratch->vm_id	= vm_id;
-	scratch->cpu_id = cpu_id;
-
-	return get_vcpu_state(vm_id, cpu_id);
+	scratch->vm_id	= state->vm_id;
+	scratch->cpu_id = state->cpu_id;
+	scratch->vcpu	= state;
 }
 
 int sm_prepare_mmio(uint64_t cpu_id) {
 	unsigned long vm_id = get_vm_id();
 
 	struct vcpu_state *state = get_vcpu_state(vm_id, cpu_id);
+	if (!state)
+		return 1;
 
-	spin_lock(&state->lock);
+	if (!claim_vcpu(state)) {
+		sbi_printf("M mode: %s : CPU %ld is running\n", __func__,
+			   cpu_id);
+		return 2;
+	}
 
 	state->next_mmio = true;
 
-	spin_unlock(&state->lock);
+	release_vcpu(state);
 
 	return 0;
 }
 
 int sm_create_cpu(uint64_t cpu_id, const struct sbi_trap_regs *regs)
 {
-	if (cpu_id >= STORED_STATES) {
-		return 1;
-	}
-
 	// TODO: keep track of creations so that hypervisor cannot abuse
 
-	spin_lock(&global_lock);
-
 	unsigned long vm_id = get_vm_id();
 
+	spin_lock(vm_lock(vm_id));
+
 	struct vcpu_state *state = get_vcpu_state(vm_id, cpu_id);
+	bool created		 = false;
+	if (!state) {
+		state = alloc_vcpu_state(vm_id);
+		if (!state) {
+			spin_unlock(vm_lock(vm_id));
+			sbi_printf("M mode: %s : no free vCPU state\n",
+				   __func__);
+			return 1;
+		}
+		state->vm_id  = vm_id;
+		state->cpu_id = cpu_id;
+		atomic_write(&state->status, VCPU_EXITING);
+		created	      = true;
+	} else if (!claim_vcpu(state)) {
+		spin_unlock(vm_lock(vm_id));
+		sbi_printf("M mode: %s : CPU %ld is running\n", __func__,
+			   cpu_id);
+		return 2;
+	}
 
 	sbi_memcpy(&state->vcpu_state, regs, sizeof(struct sbi_trap_regs));
 	state->vcpu_state.a1 = csr_read(CSR_STVAL);
@@ -523,40 +1227,370 @@ int sm_create_cpu(uint64_t cpu_id, const struct sbi_trap_regs *regs)
 
 	state->next_mmio = false;
 	state->prev_mmio_insn = 0;
+	atomic_write(&state->run_page, 0);
+	state->vssip_pending  = 0;
 
 	mask_hgatp(state);
 
-	SPIN_LOCK_INIT(state->lock);
-	state->running = false;
+	release_vcpu(state);
+
+	if (created && insert_vcpu_state(state)) {
+		// unreachable, the table has more slots than the arenas
+		sbi_printf("M mode: %s : vCPU registry is full\n", __func__);
+	}
 
-	spin_unlock(&global_lock);
+	spin_unlock(vm_lock(vm_id));
 
 	return 0;
 }
 
-int sm_resume_cpu(uint64_t cpu_id, struct sbi_trap_regs *regs)
+// guest physical address of a guest page fault
+static inline uintptr_t trap_gpa(const struct sbi_trap_info *trap)
 {
-	if (cpu_id >= STORED_STATES) {
-		return 1;
+	return (trap->tval2 << 2) | (trap->tval & 0x3);
+}
+
+/*
+ * The faulting load/store, taken from mtinst when the hardware reports a
+ * transformed instruction, so the guest memory is not read. exposed is
+ * what the host gets, in the same format as htinst.
+ */
+static inline ulong mmio_insn(struct sbi_trap_regs *regs,
+			      const struct sbi_trap_info *trap, ulong *exposed)
+{
+	if (trap->tinst & 0x1) {
+		*exposed = trap->tinst;
+		return trap->tinst | INSN_16BIT_MASK;
+	}
+
+	struct sbi_trap_info utrap;
+	*exposed = sbi_get_insn(regs->mepc, &utrap);
+	return *exposed;
+}
+
+int sm_set_run_page(uint64_t cpu_id, uintptr_t addr)
+{
+	unsigned long vm_id = get_vm_id();
+	if (addr & (PAGE_SIZE - 1) || in_sm_region(addr, addr + PAGE_SIZE)) {
+		sbi_printf("M mode: %s : invalid run page 0x%lx\n", __func__,
+			   addr);
+		return -1;
+	}
+
+	spin_lock(vm_lock(vm_id));
+	struct vcpu_state *state = get_vcpu_state(vm_id, cpu_id);
+	if (!state) {
+		spin_unlock(vm_lock(vm_id));
+		sbi_printf("M mode: %s : CPU %ld is not created\n", __func__,
+			   cpu_id);
+		return -1;
+	}
+
+	if (!claim_vcpu(state)) {
+		spin_unlock(vm_lock(vm_id));
+		sbi_printf("M mode: %s : CPU %ld is running\n", __func__,
+			   cpu_id);
+		return -1;
+	}
+
+	// checked once, set_private_memory revokes it if it becomes private
+	lock_bitmap;
+	int ret = (addr && contain_private_range(addr >> PAGE_SHIFT, 1)) ? -1
+									 : 0;
+	if (!ret)
+		atomic_write(&state->run_page, addr);
+	unlock_bitmap;
+
+	release_vcpu(state);
+	spin_unlock(vm_lock(vm_id));
+
+	if (ret)
+		sbi_printf("M mode: %s : run page 0x%lx is not public\n",
+			   __func__, addr);
+	return ret;
+}
+
+/*
+ * Access the run page of a vCPU, the caller owns the vCPU. RUN_PAGE_BUSY
+ * keeps revoke_run_pages from taking the page away meanwhile, so the world
+ * switch does not need the bitmap lock.
+ */
+static struct sm_run_page *lock_run_page(struct vcpu_state *state)
+{
+	long page = atomic_read(&state->run_page);
+
+	// fails if the page was revoked since it was read
+	if (!page || atomic_cmpxchg(&state->run_page, page,
+				    page | RUN_PAGE_BUSY) != page)
+		return NULL;
+	return (struct sm_run_page *)page;
+}
+
+static inline void unlock_run_page(struct vcpu_state *state,
+				   struct sm_run_page *run)
+{
+	// the accesses to the page are done before it can be revoked
+	smp_mb();
+	atomic_write(&state->run_page, (long)run);
+}
+
+// size in bytes of the data of a MMIO load/store
+static ulong mmio_access_size(ulong insn)
+{
+	if ((insn & INSN_16BIT_MASK) == INSN_16BIT_MASK)
+		return 1UL << ((insn >> 12) & 0x3);
+#if __riscv_xlen == 64
+	if ((insn & INSN_MASK_C_LD) == INSN_MATCH_C_LD ||
+	    (insn & INSN_MASK_C_SD) == INSN_MATCH_C_SD ||
+	    (insn & INSN_MASK_C_LDSP) == INSN_MATCH_C_LDSP ||
+	    (insn & INSN_MASK_C_SDSP) == INSN_MATCH_C_SDSP)
+		return 8;
+#endif
+	return 4;
+}
+
+// put the response of the host in the run page into the trap frame
+static void read_run_page(struct sbi_trap_regs *regs,
+			  struct vcpu_state *state)
+{
+	struct sm_run_page *run = lock_run_page(state);
+	if (!run)
+		return;
+
+	switch (state->trap.cause) {
+	case CAUSE_VIRTUAL_SUPERVISOR_ECALL:
+		regs->a0 = run->ret_gprs[0];
+		regs->a1 = run->ret_gprs[1];
+		regs->a2 = run->ret_gprs[2];
+		regs->a3 = run->ret_gprs[3];
+		regs->a4 = run->ret_gprs[4];
+		regs->a5 = run->ret_gprs[5];
+		regs->a6 = run->ret_gprs[6];
+		regs->a7 = run->ret_gprs[7];
+		break;
+	case CAUSE_LOAD_GUEST_PAGE_FAULT: {
+		ulong insn = state->prev_mmio_insn;
+		if (!insn)
+			break;
+		if ((insn & INSN_MASK_C_LW) == INSN_MATCH_C_LW)
+			insn = RVC_RS2S(insn) << SH_RD;
+#if __riscv_xlen == 64
+		else if ((insn & INSN_MASK_C_LD) == INSN_MATCH_C_LD)
+			insn = RVC_RS2S(insn) << SH_RD;
+#endif
+		SET_RD(insn, regs, run->ret_value);
+	} break;
+	case CAUSE_VIRTUAL_INST_FAULT:
+		if (state->was_csr_insn)
+			SET_RD(state->trap.tval, regs, run->ret_value);
+		break;
+	default:
+		break;
+	}
+
+	unlock_run_page(state, run);
+}
+
+// write the exit record, regs is the frame already hidden for the host
+static void write_run_page(const struct sbi_trap_regs *regs,
+			   const struct sbi_trap_info *trap,
+			   struct vcpu_state *state, ulong exposed)
+{
+	struct sm_run_page *run = lock_run_page(state);
+	if (!run)
+		return;
+
+	run->cause	 = trap->cause;
+	run->tval	 = trap->tval;
+	run->gpa	 = 0;
+	run->insn	 = 0;
+	run->access_size = 0;
+	run->data	 = 0;
+
+	switch (trap->cause) {
+	case CAUSE_VIRTUAL_SUPERVISOR_ECALL:
+		run->gprs[0] = regs->a0;
+		run->gprs[1] = regs->a1;
+		run->gprs[2] = regs->a2;
+		run->gprs[3] = regs->a3;
+		run->gprs[4] = regs->a4;
+		run->gprs[5] = regs->a5;
+		run->gprs[6] = regs->a6;
+		run->gprs[7] = regs->a7;
+		break;
+	case CAUSE_LOAD_GUEST_PAGE_FAULT:
+	case CAUSE_STORE_GUEST_PAGE_FAULT:
+		run->gpa = trap_gpa(trap);
+		if (state->prev_mmio_insn) {
+			run->insn	 = exposed;
+			run->access_size = mmio_access_size(state->prev_mmio_insn);
+			if (trap->cause == CAUSE_STORE_GUEST_PAGE_FAULT)
+				run->data = regs->a0;
+		}
+		break;
+	case CAUSE_FETCH_GUEST_PAGE_FAULT:
+		run->gpa = trap_gpa(trap);
+		break;
+	case CAUSE_VIRTUAL_INST_FAULT:
+		run->insn = trap->tval;
+		if (state->was_csr_insn)
+			run->data = GET_RS1(trap->tval, regs);
+		break;
+	default:
+		break;
+	}
+
+	unlock_run_page(state, run);
+}
+
+// deliver a pending IPI to the vCPU running on this hart
+static void sm_vcpu_ipi_process(struct sbi_scratch *scratch)
+{
+	struct vcpu_state *state = scratch->vcpu;
+	if (state &&
+	    atomic_read(&state->status) == VCPU_RUNNING_ON(current_hartid()) &&
+	    atomic_raw_xchg_ulong(&state->vssip_pending, 0))
+		csr_set(CSR_HVIP, MIP_VSSIP);
+}
+
+#ifdef CONFIG_SBI_ECALL_SM_FAST_TIME
+static int sm_guest_set_timer(struct sbi_trap_regs *regs)
+{
+	// the host must have given vstimecmp to the guest
+	if (!sbi_hart_has_extension(sbi_scratch_thishart_ptr(),
+				    SBI_HART_EXT_SSTC))
+		return -1;
+#if __riscv_xlen == 32
+	if (!(csr_read(CSR_HENVCFGH) & ENVCFGH_STCE))
+		return -1;
+	csr_write(CSR_VSTIMECMP, regs->a0);
+	csr_write(CSR_VSTIMECMPH, regs->a1);
+#else
+	if (!(csr_read(CSR_HENVCFG) & ENVCFG_STCE))
+		return -1;
+	csr_write(CSR_VSTIMECMP, regs->a0);
+#endif
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_SBI_ECALL_SM_FAST_IPI
+/*
+ * Raise VSSIP on the harts of the running targets. The targets that are
+ * not running are left in a0 for the host.
+ */
+static int sm_guest_send_ipi(struct vcpu_state *state,
+			     struct sbi_trap_regs *regs)
+{
+	ulong mask = regs->a0, base = regs->a1, remaining = 0;
+	if (base == -1UL)
+		return -1;
+
+	for (int i = 0; i < __riscv_xlen; i++) {
+		if (!(mask & (1UL << i)))
+			continue;
+		struct vcpu_state *target = get_vcpu_state(state->vm_id, base + i);
+		if (!target) {
+			remaining |= 1UL << i;
+			continue;
+		}
+
+		/*
+		 * Mark the IPI before looking at the status: a target that
+		 * exits after this is handed the IPI by sm_preserve_cpu.
+		 */
+		atomic_raw_xchg_ulong(&target->vssip_pending, 1);
+		long status = atomic_read(&target->status);
+		if ((status & VCPU_STATUS_MASK) != VCPU_RUNNING) {
+			// the host delivers it
+			atomic_raw_xchg_ulong(&target->vssip_pending, 0);
+			remaining |= 1UL << i;
+			continue;
+		}
+
+		ulong hartid = status >> VCPU_STATUS_SHIFT;
+		if (hartid == current_hartid())
+			sm_vcpu_ipi_process(sbi_scratch_thishart_ptr());
+		else
+			sbi_ipi_send_many(1UL, hartid, sm_vcpu_ipi_event, NULL);
+	}
+
+	regs->a0 = remaining;
+	return remaining ? -1 : 0;
+}
+#endif
+
+int sm_guest_ecall(struct sbi_trap_regs *regs)
+{
+	struct vcpu_state *state = sbi_scratch_thishart_ptr()->vcpu;
+	int ret			 = -1;
+
+	// only guests run by sm_resume_cpu
+	if (!state ||
+	    atomic_read(&state->status) != VCPU_RUNNING_ON(current_hartid()))
+		return -1;
+
+	switch (regs->a7) {
+#ifdef CONFIG_SBI_ECALL_SM_FAST_TIME
+	case SBI_EXT_TIME:
+		if (regs->a6 == SBI_EXT_TIME_SET_TIMER)
+			ret = sm_guest_set_timer(regs);
+		break;
+#endif
+#ifdef CONFIG_SBI_ECALL_SM_FAST_IPI
+	case SBI_EXT_IPI:
+		if (regs->a6 == SBI_EXT_IPI_SEND_IPI &&
+		    sm_vcpu_ipi_event >= 0)
+			ret = sm_guest_send_ipi(state, regs);
+		break;
+#endif
+	default:
+		break;
 	}
 
-	regs->a1 = csr_read(CSR_STVAL);
-	regs->a7 = csr_read(CSR_SCAUSE);
+	if (ret)
+		return ret;
 
-	struct vcpu_state *state = sm_prepare_cpu(cpu_id);
+	regs->a0 = SBI_SUCCESS;
+	regs->mepc += 4;
+	return 0;
+}
 
-	spin_lock(&state->lock);
+int sm_resume_cpu(uint64_t cpu_id, struct sbi_trap_regs *regs)
+{
+	unsigned long vm_id	 = get_vm_id();
+	struct vcpu_state *state = get_vcpu_state(vm_id, cpu_id);
+	if (!state) {
+		sbi_printf("CPU %ld is not created!", cpu_id);
+		return 1;
+	}
 
-	if (state->running) {
+	// only one HART may take the vCPU, the others fail here
+	if (atomic_cmpxchg(&state->status, VCPU_IDLE,
+			   VCPU_RUNNING_ON(current_hartid())) != VCPU_IDLE) {
 		sbi_printf("CPU %ld is already running!", cpu_id);
 		return 2;
 	}
 
-	state->running = true;
+	// the VM may have been destroyed and the state reused since the lookup
+	if (state->vm_id != vm_id || state->cpu_id != cpu_id) {
+		release_vcpu(state);
+		sbi_printf("CPU %ld is not created!", cpu_id);
+		return 1;
+	}
+
+	sm_prepare_cpu(state);
 
-	ulong sepc = csr_read(CSR_SEPC);
+	// the exit is answered in the run page, or in the CSRs and a0-a7
+	if (atomic_read(&state->run_page)) {
+		read_run_page(regs, state);
+	} else {
+		regs->a1 = csr_read(CSR_STVAL);
+		regs->a7 = csr_read(CSR_SCAUSE);
+	}
 
 	int ret = 0;
+	ulong sepc;
 
 	switch (state->trap.cause) {
 	case CAUSE_VIRTUAL_SUPERVISOR_ECALL: {
@@ -588,6 +1622,7 @@ int sm_resume_cpu(uint64_t cpu_id, struct sbi_trap_regs *regs)
 
 	case CAUSE_VIRTUAL_INST_FAULT: {
 		// Supervisor trying to return to next instruction
+		sepc = csr_read(CSR_SEPC);
 
 		if (sepc == state->vcpu_state.mepc + 4) {
 			restore_registers(regs, state);
@@ -608,6 +1643,7 @@ int sm_resume_cpu(uint64_t cpu_id, struct sbi_trap_regs *regs)
 	case IRQ_S_TIMER_FLIPPED:
 	case IRQ_S_EXT_FLIPPED:
 	case IRQ_S_GEXT_FLIPPED: {
+		sepc = csr_read(CSR_SEPC);
 		if (sepc == state->vcpu_state.mepc) {
 			restore_registers(regs, state);
 			prepare_for_vm(regs, state);
@@ -637,9 +1673,12 @@ int sm_resume_cpu(uint64_t cpu_id, struct sbi_trap_regs *regs)
 		break;
 	}
 
-trap_error:
+	return ret;
 
-	spin_unlock(&state->lock);
+trap_error:
+	// the guest was not entered, give the vCPU back to the host
+	sbi_scratch_thishart_ptr()->vcpu = NULL;
+	release_vcpu(state);
 
 	return ret;
 }
@@ -662,7 +1701,7 @@ bool is_csr_fn(struct sbi_trap_info *trap)
 	return is_csr;
 }
 
-inline void hide_registers(struct sbi_trap_regs *regs,
+static inline void hide_registers(struct sbi_trap_regs *regs,
 			   struct sbi_trap_info *trap, struct vcpu_state *state,
 			   bool is_virtual_insn_fault)
 {
@@ -670,112 +1709,60 @@ inline void hide_registers(struct sbi_trap_regs *regs,
 	bool is_csr = is_virtual_insn_fault && is_csr_fn(trap);
 
 	state->was_csr_insn = is_csr;
-	ulong saved_value   = 0;
-
-	if (is_csr && is_virtual_insn_fault)
-		saved_value = GET_RS1(insn, regs);
-
-	ulong epc     = regs->mepc;
-	ulong status  = regs->mstatus;
-	ulong statusH = regs->mstatusH;
-
-	sbi_memset(regs, 0, sizeof(struct sbi_trap_regs));
 
-	regs->mepc     = epc;
-	regs->mstatus  = status;
-	regs->mstatusH = statusH;
-
-	if (is_csr && is_virtual_insn_fault)
-		*REG_PTR(insn, SH_RS1, regs) = saved_value;
+	// the host needs rs1 to emulate a CSR write
+	clear_gprs(regs, is_csr ? GPR_BIT(insn, SH_RS1) : 0);
 }
 
-inline void hide_registers_ecall(struct sbi_trap_regs *regs,
+static inline void hide_registers_ecall(struct sbi_trap_regs *regs,
 			   struct sbi_trap_info *trap, struct vcpu_state *state)
 {
 	// sbi_printf("ECALL: %lu %lu\n", regs->a6, regs->a7);
 
-	ulong epc     = regs->mepc;
-	ulong status  = regs->mstatus;
-	ulong statusH = regs->mstatusH;
-	ulong a0 = regs->a0;
-	ulong a1 = regs->a1;
-	ulong a2 = regs->a2;
-	ulong a3 = regs->a3;
-	ulong a4 = regs->a4;
-	ulong a5 = regs->a5;
-	ulong a6 = regs->a6;
-	ulong a7 = regs->a7;
-
-	sbi_memset(regs, 0, sizeof(struct sbi_trap_regs));
-
-	regs->mepc     = epc;
-	regs->mstatus  = status;
-	regs->mstatusH = statusH;
-
-	regs->a0 = a0; 
-	regs->a1 = a1; 
-	regs->a2 = a2; 
-	regs->a3 = a3; 
-	regs->a4 = a4; 
-	regs->a5 = a5; 
-	regs->a6 = a6; 
-	regs->a7 = a7; 
+	clear_gprs(regs, GPR_A0_A7);
 }
 
-inline void hide_registers_mmio_store(struct sbi_trap_regs *regs,
-			   struct vcpu_state *state, unsigned long insn) {
-	ulong data = GET_RS2(insn, regs);
-
+static inline void hide_registers_mmio_store(struct sbi_trap_regs *regs,
+					     struct vcpu_state *state,
+					     ulong insn, ulong exposed)
+{
+	ulong *src = REG_PTR(insn, SH_RS2, regs);
 
-	if ((insn & INSN_MASK_SW) == INSN_MATCH_SW) {
-		// empty case
-	}
 #if __riscv_xlen == 64
 	if ((insn & INSN_MASK_C_SD) == INSN_MATCH_C_SD) {
-		data = GET_RS2S(insn, regs);
+		src = REG_PTR(RVC_RS2S(insn), 0, regs);
 	} else if ((insn & INSN_MASK_C_SDSP) == INSN_MATCH_C_SDSP &&
 		   ((insn >> SH_RD) & 0x1f)) {
-		data = GET_RS2C(insn, regs);
-	}
+		src = REG_PTR(insn, SH_RS2C, regs);
+	} else
 #endif
-	else if ((insn & INSN_MASK_C_SW) == INSN_MATCH_C_SW) {
-		data = GET_RS2S(insn, regs);
+	if ((insn & INSN_MASK_C_SW) == INSN_MATCH_C_SW) {
+		src = REG_PTR(RVC_RS2S(insn), 0, regs);
 	} else if ((insn & INSN_MASK_C_SWSP) == INSN_MATCH_C_SWSP &&
 		   ((insn >> SH_RD) & 0x1f)) {
-		data = GET_RS2C(insn, regs);
+		src = REG_PTR(insn, SH_RS2C, regs);
 	}
 
-	ulong epc     = regs->mepc;
-	ulong status  = regs->mstatus;
-	ulong statusH = regs->mstatusH;
-
-	// sbi_memset(regs, 0, sizeof(struct sbi_trap_regs));
-
-	regs->mepc     = epc;
-	regs->mstatus  = status;
-	regs->mstatusH = statusH;
+	// only the store data is left, in its register and in a0
+	ulong data = *src;
+	clear_gprs(regs, 1U << (src - (ulong *)regs));
 
 	regs->a0 = data;
-	regs->a1 = insn;
+	regs->a1 = exposed;
 
+	state->was_csr_insn   = false;
 	state->prev_mmio_insn = insn;
 }
 
-
-inline void hide_registers_mmio_load(struct sbi_trap_regs *regs, struct vcpu_state *state, ulong insn)
+static inline void hide_registers_mmio_load(struct sbi_trap_regs *regs,
+					    struct vcpu_state *state,
+					    ulong insn, ulong exposed)
 {
-	ulong epc     = regs->mepc;
-	ulong status  = regs->mstatus;
-	ulong statusH = regs->mstatusH;
-
-	sbi_memset(regs, 0, sizeof(struct sbi_trap_regs));
+	clear_gprs(regs, 0);
 
-	regs->mepc     = epc;
-	regs->mstatus  = status;
-	regs->mstatusH = statusH;
-
-	regs->a1 = insn;
+	regs->a1 = exposed;
 
+	state->was_csr_insn   = false;
 	state->prev_mmio_insn = insn;
 }
 
@@ -784,30 +1771,37 @@ int sm_preserve_cpu(struct sbi_trap_regs *regs, struct sbi_trap_info *trap)
 	struct sbi_scratch *scratch = sbi_scratch_thishart_ptr();
 
 	int cpu_id = scratch->cpu_id;
-	int vm_id  = scratch->vm_id;
 
-	if (cpu_id >= STORED_STATES) {
+	// set by sm_resume_cpu, the vCPU running on this hart
+	struct vcpu_state *state = scratch->vcpu;
+	if (!state || state->vm_id != scratch->vm_id ||
+	    state->cpu_id != scratch->cpu_id) {
 		return 1;
 	}
 
-	struct vcpu_state *state = get_vcpu_state(vm_id, cpu_id);
-
-	spin_lock(&state->lock);
-
-	if (!state->running) {
+	if (atomic_cmpxchg(&state->status, VCPU_RUNNING_ON(current_hartid()),
+			   VCPU_EXITING) != VCPU_RUNNING_ON(current_hartid())) {
 		sbi_printf("CPU %d is not running yet!", cpu_id);
 		return 2;
 	}
 
-	sbi_memcpy(&state->vcpu_state, regs, sizeof(struct sbi_trap_regs));
-	sbi_memcpy(&state->trap, trap, sizeof(struct sbi_trap_info));
+	copy_gprs(&state->vcpu_state, regs, 0);
+	state->vcpu_state.mepc	   = regs->mepc;
+	state->vcpu_state.mstatus  = regs->mstatus;
+	state->vcpu_state.mstatusH = regs->mstatusH;
 
-	state->running = false;
+	state->trap.epc	  = trap->epc;
+	state->trap.cause = trap->cause;
+	state->trap.tval  = trap->tval;
+	state->trap.tval2 = trap->tval2;
+	state->trap.tinst = trap->tinst;
+	state->trap.gva	  = trap->gva;
 
-	csr_write(CSR_MIDELEG,
-		  csr_read(CSR_MIDELEG) | MIP_SSIP | MIP_STIP | MIP_SEIP);
-	csr_write(CSR_MEDELEG, state->prev_exception);
+	set_delegation(&scratch->world_switch,
+		       scratch->world_switch.host_mideleg,
+		       scratch->world_switch.host_medeleg);
 
+	ulong exposed = 0;
 	switch (trap->cause) {
 	case CAUSE_FETCH_ACCESS:
 	case CAUSE_FETCH_GUEST_PAGE_FAULT: {
@@ -816,13 +1810,14 @@ int sm_preserve_cpu(struct sbi_trap_regs *regs, struct sbi_trap_info *trap)
 	break;
 	case CAUSE_LOAD_GUEST_PAGE_FAULT:
 	case CAUSE_STORE_GUEST_PAGE_FAULT: {
-		if (state->next_mmio) {
+		if (state->next_mmio || is_mmio_gpa(state->vm_id, trap_gpa(trap))) {
 			state->next_mmio = false;
-			struct sbi_trap_info utrap;
-			ulong insn = sbi_get_insn(regs->mepc, &utrap);
+			ulong insn = mmio_insn(regs, trap, &exposed);
 
-			if (trap->cause == CAUSE_STORE_GUEST_PAGE_FAULT) hide_registers_mmio_store(regs, state, insn);
-			else hide_registers_mmio_load(regs, state, insn);
+			if (trap->cause == CAUSE_STORE_GUEST_PAGE_FAULT)
+				hide_registers_mmio_store(regs, state, insn, exposed);
+			else
+				hide_registers_mmio_load(regs, state, insn, exposed);
 		} else {
 			hide_registers(regs, trap, state, false);
 		}
@@ -842,9 +1837,16 @@ int sm_preserve_cpu(struct sbi_trap_regs *regs, struct sbi_trap_info *trap)
 		break;
 	}
 
+	if (atomic_read(&state->run_page))
+		write_run_page(regs, trap, state, exposed);
+
+	// an IPI from a sibling that has not arrived yet goes to the host
+	if (atomic_raw_xchg_ulong(&state->vssip_pending, 0))
+		csr_set(CSR_HVIP, MIP_VSSIP);
+
 	mask_hgatp(state);
 
-	spin_unlock(&state->lock);
+	release_vcpu(state);
 
 	return 0;
 }
@@ -862,24 +1864,22 @@ int get_page_num(uintptr_t pte_addr)
 }
 
 /**
- * @brief Check if the action is valid, then perform it
+ * @brief Check if the action is valid
  *
  * @param addr physical address of the entry
  * @param pte the new value of the entry
- * @param page_num The number of pages to be set
+ * @param page_num The number of pages the entry covers (get_page_num)
  * @return 0 on success, negative error code on failure
  */
-inline int check_set_single_pte(unsigned long *addr, unsigned long pte,
-				size_t page_num)
+static int check_single_pte(unsigned long *addr, unsigned long pte,
+			    int page_num)
 {
-	if (unlikely(check_enabled == false)) {
-		set_single_pte(addr, pte, page_num);
+	if (unlikely(check_enabled == false))
 		return 0;
-	}
 	if (page_num < 0) {
 		sbi_printf(
 			"sm_set_pte: addr outside HPT (addr: 0x%lx, pte: 0x%lx, page_num: %lu)\n",
-			(unsigned long)addr, pte, page_num);
+			(unsigned long)addr, pte, (unsigned long)page_num);
 		return -1;
 	}
 	if (pte & PTE_V) {
@@ -907,18 +1907,128 @@ inline int check_set_single_pte(unsigned long *addr, unsigned long pte,
 			if (!test_public_shared_range(pte_to_ppn(pte),
 						      page_num)) {
 				sbi_printf(
-					"Invalid page table leaf entry, contains private range(addr 0x%lx, pte 0x%lx, page_num %ld)\n",
+					"Invalid page table leaf entry, contains private range(addr 0x%lx, pte 0x%lx, page_num %d)\n",
 					(uintptr_t)addr, pte, page_num);
 				return -1;
 			}
 		}
 	}
 
+	return 0;
+}
+
+/**
+ * @brief Check if the action is valid, then perform it
+ *
+ * @param addr physical address of the entry
+ * @param pte the new value of the entry
+ * @param page_num The number of pages the entry covers (get_page_num)
+ * @return 0 on success, negative error code on failure
+ */
+static inline int check_set_single_pte(unsigned long *addr, unsigned long pte,
+				       int page_num)
+{
+	if (unlikely(check_enabled == false)) {
+		set_single_pte(addr, pte, page_num);
+		return 0;
+	}
+	if (check_single_pte(addr, pte, page_num))
+		return -1;
+
 	return set_single_pte(addr, pte, page_num);
 }
 
+/**
+ * @brief Copy entries, only checking the ones that change
+ *
+ * Entries equal to the destination were validated when they were written
+ * and already have their reverse map, so they are skipped. All entries in
+ * one page-table page are in the same HPT Area section, so get_page_num is
+ * only evaluated once per page.
+ *
+ * @param addr physical address of the destination entries
+ * @param src physical address of the source entries
+ * @param num the number of entries
+ * @return 0 on success, negative error code on failure
+ */
+static int check_set_pte_memcpy(unsigned long *addr, const unsigned long *src,
+				size_t num)
+{
+	int page_num = 0;
+
+	for (size_t i = 0; i < num; ++i, ++addr) {
+		if (i == 0 || !((uintptr_t)addr & (PAGE_SIZE - 1)))
+			page_num = get_page_num((uintptr_t)addr);
+		if (*addr == src[i])
+			continue;
+		if (unlikely(check_set_single_pte(addr, src[i], page_num)))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Validate a whole array of updates, then apply it
+ *
+ * The array is in host memory that other HARTs may write to, so it is
+ * copied once and both validated and applied from the copy.
+ *
+ * @param buf physical address of the array of updates
+ * @param size the size of the array in bytes
+ * @param failed the index of the first failing update, the number of
+ *               updates if none fails
+ * @param applied the number of updates written
+ * @return 0 on success, negative error code on failure
+ */
+static int check_set_pte_batch(uintptr_t buf, size_t size,
+			       unsigned long *failed, unsigned long *applied)
+{
+	struct sm_pte_update updates[SM_PTE_BATCH_MAX];
+	int page_num[SM_PTE_BATCH_MAX];
+	size_t num = size / sizeof(struct sm_pte_update), i = 0, written = 0;
+	int ret	   = -1;
+
+	if (size % sizeof(struct sm_pte_update) || num > SM_PTE_BATCH_MAX ||
+	    buf & (sizeof(unsigned long) - 1) || in_sm_region(buf, buf + size)) {
+		sbi_printf(
+			"sm_set_pte: SBI_EXT_SM_SET_PTE_BATCH: invalid array (addr: 0x%lx, size: %lu)\n",
+			buf, (unsigned long)size);
+		goto out;
+	}
+	sbi_memcpy(updates, (const void *)buf, size);
+
+	for (i = 0; i < num; i++) {
+		unsigned long *addr = (unsigned long *)updates[i].addr;
+		page_num[i]	    = get_page_num((uintptr_t)addr);
+		if (unlikely(page_num[i] < 0 ||
+			     check_single_pte(addr, updates[i].pte, page_num[i]))) {
+			sbi_printf(
+				"sm_set_pte: SBI_EXT_SM_SET_PTE_BATCH: entry %lu rejected\n",
+				(unsigned long)i);
+			goto out;
+		}
+	}
+
+	// only fails if the reverse map runs out, the writes before stay
+	for (i = 0; i < num; i++, written++) {
+		if (unlikely(set_single_pte((unsigned long *)updates[i].addr,
+					    updates[i].pte, page_num[i])))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	if (failed)
+		*failed = i;
+	if (applied)
+		*applied = written;
+	return ret;
+}
+
 int sm_set_pte(unsigned long sub_fid, unsigned long *addr,
-	       unsigned long pte_or_src, size_t size)
+	       unsigned long pte_or_src, size_t size, unsigned long *failed,
+	       unsigned long *applied)
 {
 	int ret = 0;
 	lock_bitmap;
@@ -934,20 +2044,19 @@ int sm_set_pte(unsigned long sub_fid, unsigned long *addr,
 			sbi_printf(
 				"sm_set_pte: SBI_EXT_SM_SET_PTE_MEMCPY: size align failed (addr: 0x%lx, src: 0x%lx, size: %lu)\n",
 				(unsigned long)addr, pte_or_src, size);
+			break;
 		}
-		size_t page_num = size >> 3;
-		for (size_t i = 0; i < page_num; ++i, ++addr) {
-			uintptr_t pte = *((uintptr_t *)pte_or_src + i);
-			ret	      = check_set_single_pte(
-				  addr, pte, get_page_num((uintptr_t)addr));
-			if (unlikely(ret))
-				break;
-		}
+		ret = check_set_pte_memcpy(addr, (const unsigned long *)pte_or_src,
+					   size >> 3);
 		break;
 	case SBI_EXT_SM_SET_PTE_SET_ONE:
 		ret = check_set_single_pte(addr, pte_or_src,
 					   get_page_num((uintptr_t)addr));
 		break;
+	case SBI_EXT_SM_SET_PTE_BATCH:
+		ret = check_set_pte_batch((uintptr_t)addr, size, failed,
+					  applied);
+		break;
 	default:
 		ret = -1;
 		break;
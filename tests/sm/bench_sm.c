@@ -0,0 +1,492 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Benchmarks of the SM memory structures: sm_set_pte, range conversions,
+ * unmap_range, reverse map deletion and monitor_init, on a synthetic HPT
+ * Area. And round trips through the world switch, and firmware counter
+ * increments and world switches on several harts at once.
+ */
+
+#include "host.h"
+#include "hpt.h"
+#include "world_switch.h"
+#include <sbi/riscv_asm.h>
+#include <sbi/riscv_locks.h>
+#include <sbi/sbi_ecall_interface.h>
+#include <sbi/sbi_pmu.h>
+#include <sbi/sbi_scratch.h>
+#include <sbi/sbi_string.h>
+#include <sm/bitmap.h>
+#include <sm/reverse_map.h>
+#include <sm/sm.h>
+
+#define BENCH_DRAM_PAGES (1UL << 20)
+// PTE pages of leaves, each leaf maps every other pfn from BENCH_PFN
+#define BENCH_PTE_PAGES 64
+#define BENCH_LEAVES (BENCH_PTE_PAGES * HPT_ENTRIES)
+#define BENCH_PFN HPT_DRAM_PFN(1UL << 18)
+
+static struct hpt_area hpt;
+
+static void report(const char *name, u64 ns, u64 ops)
+{
+	host_printf("%-40s %10.1f ns/op %12.0f ops/s\n", name, (double)ns / ops,
+		    ops * 1e9 / ns);
+}
+
+/*
+ * Run fn until the time is up. fn does ops operations and returns the time
+ * they took, so that it can prepare the next call outside of it.
+ */
+static void bench(const char *name, u64 ops, u64 (*fn)(u64 iter))
+{
+	u64 limit = host_bench_seconds() * 1e9;
+	u64 start = host_time_ns(), ns = 0, iter = 0;
+
+	while (host_time_ns() - start < limit || !iter)
+		ns += fn(iter++);
+	report(name, ns, iter * ops);
+}
+
+static uintptr_t leaf(u64 i)
+{
+	return HPT_LEAF(BENCH_PFN + 2 * i);
+}
+
+// map BENCH_LEAVES leaves at [0, BENCH_LEAVES pages), hpt.pte[i] is leaf i
+static void populate(void)
+{
+	TEST_ASSERT(hpt_area_reset(&hpt) == 0);
+	for (u64 i = 0; i < BENCH_LEAVES; i++)
+		TEST_ASSERT(hpt_map(&hpt, 0, i << PAGE_SHIFT,
+				    BENCH_PFN + 2 * i, HPT_4K) == 0);
+}
+
+/* sm_set_pte */
+
+#define SET_ONE_OPS 512
+
+static u64 set_one(u64 iter)
+{
+	// replace valid leaves: delete and add a reverse map each
+	u64 shift = (iter & 1) ? 1 : 0;
+	u64 start = host_time_ns();
+	for (u64 i = 0; i < SET_ONE_OPS; i++)
+		sm_set_pte(SBI_EXT_SM_SET_PTE_SET_ONE, &hpt.pte[i],
+			   leaf(i + shift), 0, NULL, NULL);
+	return host_time_ns() - start;
+}
+
+static uintptr_t memcpy_src[2][HPT_ENTRIES];
+
+static u64 set_memcpy(u64 iter)
+{
+	u64 start = host_time_ns();
+	sm_set_pte(SBI_EXT_SM_SET_PTE_MEMCPY, hpt.pte,
+		   (unsigned long)memcpy_src[iter & 1], PAGE_SIZE, NULL, NULL);
+	return host_time_ns() - start;
+}
+
+static u64 set_memcpy_same(u64 iter)
+{
+	u64 start = host_time_ns();
+	sm_set_pte(SBI_EXT_SM_SET_PTE_MEMCPY, hpt.pte,
+		   (unsigned long)memcpy_src[0], PAGE_SIZE, NULL, NULL);
+	return host_time_ns() - start;
+}
+
+static u64 set_clear(u64 iter)
+{
+	sm_set_pte(SBI_EXT_SM_SET_PTE_MEMCPY, hpt.pte,
+		   (unsigned long)memcpy_src[0], PAGE_SIZE, NULL, NULL);
+	u64 start = host_time_ns();
+	sm_set_pte(SBI_EXT_SM_SET_PTE_CLEAR, hpt.pte, 0, PAGE_SIZE, NULL, NULL);
+	return host_time_ns() - start;
+}
+
+static void bench_set_pte(void)
+{
+	populate();
+	for (u64 i = 0; i < HPT_ENTRIES; i++) {
+		memcpy_src[0][i] = leaf(i);
+		memcpy_src[1][i] = leaf(i + 1);
+	}
+	bench("set_pte set_one (replace leaf)", SET_ONE_OPS, set_one);
+	bench("set_pte memcpy (512 changed)", 1, set_memcpy);
+	bench("set_pte memcpy (512 unchanged)", 1, set_memcpy_same);
+	bench("set_pte clear (512 leaves)", 1, set_clear);
+}
+
+/* range conversions */
+
+#define RANGE_OPS 64
+
+static u64 range_pages, range_offset;
+
+static u64 range_convert(u64 iter)
+{
+	u64 start = host_time_ns();
+	for (u64 i = 0; i < RANGE_OPS / 2; i++) {
+		u64 pfn = HPT_DRAM_PFN(range_offset + ((i * range_pages) &
+						      (BENCH_DRAM_PAGES / 2 - 1)));
+		set_private_range(pfn, range_pages);
+		set_public_range(pfn, range_pages);
+	}
+	return host_time_ns() - start;
+}
+
+static u64 range_query(u64 iter)
+{
+	int found = 0;
+	u64 start = host_time_ns();
+	for (u64 i = 0; i < RANGE_OPS; i++)
+		found += contain_private_range(HPT_DRAM_PFN(range_offset),
+					       range_pages);
+	u64 ns = host_time_ns() - start;
+	TEST_ASSERT(!found);
+	return ns;
+}
+
+static void bench_ranges(void)
+{
+	static const struct {
+		const char *convert, *query;
+		u64 pages, offset;
+	} cases[] = {
+		{ "set_*_range 1 page", "contain_private_range 1 page", 1, 7 },
+		{ "set_*_range 100 pages (unaligned)",
+		  "contain_private_range 100 pages", 100, 7 },
+		{ "set_*_range 2MB (aligned)", "contain_private_range 2MB", 512,
+		  0 },
+		{ "set_*_range 1000 pages (unaligned)",
+		  "contain_private_range 1000 pages", 1000, 7 },
+		{ "set_*_range 1GB (aligned)", "contain_private_range 1GB",
+		  1UL << 18, 0 },
+	};
+
+	TEST_ASSERT(hpt_area_reset(&hpt) == 0);
+	for (int i = 0; i < array_size(cases); i++) {
+		range_pages  = cases[i].pages;
+		range_offset = cases[i].offset;
+		bench(cases[i].convert, RANGE_OPS, range_convert);
+	}
+	for (int i = 0; i < array_size(cases); i++) {
+		range_pages  = cases[i].pages;
+		range_offset = cases[i].offset;
+		bench(cases[i].query, RANGE_OPS, range_query);
+	}
+}
+
+/* unmap_range */
+
+#define UNMAP_OPS 64
+
+// unmap leaves spread over the HPT Area, then map them again untimed
+static u64 unmap_hit(u64 iter)
+{
+	u64 first = iter * UNMAP_OPS * 7;
+	u64 start = host_time_ns();
+	for (u64 i = 0; i < UNMAP_OPS; i++) {
+		u64 j = (first + i * 509) % BENCH_LEAVES;
+		unmap_range(BENCH_PFN + 2 * j, 1);
+	}
+	u64 ns = host_time_ns() - start;
+
+	unmap_flush_batch();
+	for (u64 i = 0; i < UNMAP_OPS; i++) {
+		u64 j = (first + i * 509) % BENCH_LEAVES;
+		TEST_ASSERT(!(hpt.pte[j] & PTE_V));
+		sm_set_pte(SBI_EXT_SM_SET_PTE_SET_ONE, &hpt.pte[j], leaf(j), 0,
+			   NULL, NULL);
+	}
+	return ns;
+}
+
+// pfns between the mapped ones, inside the bounds of every PTE page
+static u64 unmap_miss(u64 iter)
+{
+	u64 start = host_time_ns();
+	for (u64 i = 0; i < UNMAP_OPS; i++) {
+		u64 j = (iter * UNMAP_OPS + i * 509) % BENCH_LEAVES;
+		unmap_range(BENCH_PFN + 2 * j + 1, 1);
+	}
+	return host_time_ns() - start;
+}
+
+// 512 pages, 256 mapped leaves
+static u64 unmap_block(u64 iter)
+{
+	u64 first = (iter * HPT_ENTRIES) % BENCH_LEAVES;
+	u64 start = host_time_ns();
+	unmap_range(BENCH_PFN + 2 * first, HPT_ENTRIES);
+	u64 ns = host_time_ns() - start;
+
+	unmap_flush_batch();
+	for (u64 j = first; j < first + HPT_ENTRIES / 2; j++)
+		sm_set_pte(SBI_EXT_SM_SET_PTE_SET_ONE, &hpt.pte[j], leaf(j), 0,
+			   NULL, NULL);
+	return ns;
+}
+
+static void bench_unmap(void)
+{
+	populate();
+	bench("unmap_range 1 page (mapped)", UNMAP_OPS, unmap_hit);
+	bench("unmap_range 1 page (not mapped)", UNMAP_OPS, unmap_miss);
+	bench("unmap_range 512 pages (256 mapped)", 1, unmap_block);
+}
+
+/* reverse map chains */
+
+#define CHAIN_OPS 64
+
+static u64 chain_len;
+
+// delete a leaf from a chain of aliases of one pfn, then add it back untimed
+static u64 chain_delete(u64 iter)
+{
+	u64 first = iter * CHAIN_OPS * 61;
+	u64 ns	  = 0;
+
+	for (u64 i = 0; i < CHAIN_OPS; i++) {
+		u64 j = (first + i * 61) % chain_len;
+		u64 start = host_time_ns();
+		sm_set_pte(SBI_EXT_SM_SET_PTE_SET_ONE, &hpt.pte[j], 0, 0, NULL, NULL);
+		ns += host_time_ns() - start;
+		sm_set_pte(SBI_EXT_SM_SET_PTE_SET_ONE, &hpt.pte[j],
+			   HPT_LEAF(BENCH_PFN), 0, NULL, NULL);
+	}
+	return ns;
+}
+
+static void bench_chains(void)
+{
+	static const struct {
+		const char *name;
+		u64 len;
+	} cases[] = {
+		{ "set_pte delete (chain of 1)", 1 },
+		{ "set_pte delete (chain of 16)", 16 },
+		{ "set_pte delete (chain of 256)", 256 },
+		{ "set_pte delete (chain of 4096)", 4096 },
+	};
+
+	for (int i = 0; i < array_size(cases); i++) {
+		chain_len = cases[i].len;
+		TEST_ASSERT(hpt_area_reset(&hpt) == 0);
+		for (u64 j = 0; j < chain_len; j++)
+			TEST_ASSERT(hpt_map(&hpt, 0, j << PAGE_SHIFT, BENCH_PFN,
+					    HPT_4K) == 0);
+		bench(cases[i].name, CHAIN_OPS, chain_delete);
+	}
+}
+
+/* monitor_init */
+
+static u64 monitor(u64 iter)
+{
+	uintptr_t mstatus;
+
+	TEST_ASSERT(sm_reverse_map_init((uintptr_t)hpt.reverse_map,
+					hpt.reverse_map_size) == 0);
+	u64 start = host_time_ns();
+	TEST_ASSERT(monitor_init(&mstatus) == 0);
+	return host_time_ns() - start;
+}
+
+static void bench_monitor_init(void)
+{
+	populate();
+	bench("monitor_init (32768 leaves)", 1, monitor);
+}
+
+/* world switch */
+
+#define WS_OPS 256
+#define WS_VMID 5
+
+static int ws_cause;
+
+static u64 world_switch(u64 iter)
+{
+	struct sbi_trap_regs regs = { 0 };
+	u64 start		  = host_time_ns();
+	for (u64 i = 0; i < WS_OPS; i++)
+		TEST_ASSERT(ws_round_trip(WS_VMID, 0, ws_cause, &regs) == 0);
+	return host_time_ns() - start;
+}
+
+static void bench_world_switch(void)
+{
+	static const char *const names[WS_CAUSES] = {
+		[WS_ECALL]	  = "world switch ecall",
+		[WS_VIRTUAL_INST] = "world switch virtual instruction",
+		[WS_MMIO_LOAD]	  = "world switch MMIO load",
+		[WS_INTERRUPT]	  = "world switch interrupt",
+	};
+	struct sbi_trap_regs regs = { 0 };
+
+	ws_vm_create(WS_VMID);
+	ws_vcpu_create(WS_VMID, 0, &regs);
+	for (ws_cause = 0; ws_cause < WS_CAUSES; ws_cause++) {
+		// settle on the cause, then count the CSRs of one round trip
+		TEST_ASSERT(ws_round_trip(WS_VMID, 0, ws_cause, &regs) == 0);
+		unsigned long reads = host_csr_reads, writes = host_csr_writes;
+		TEST_ASSERT(ws_round_trip(WS_VMID, 0, ws_cause, &regs) == 0);
+		reads  = host_csr_reads - reads;
+		writes = host_csr_writes - writes;
+
+		bench(names[ws_cause], WS_OPS, world_switch);
+		host_printf("%-40s %10lu reads %6lu writes\n",
+			    "  CSRs per round trip", reads, writes);
+	}
+	TEST_ASSERT(sm_destroy_vm(WS_VMID) == 0);
+}
+
+/* contention */
+
+#define HARTS_OPS 256
+
+struct harts_bench {
+	/** Optional, before and after the timed runs */
+	void (*setup)(u32 hartid);
+	void (*check)(u32 hartid, u64 ops);
+	/** HARTS_OPS operations */
+	void (*run)(u32 hartid);
+	/** Operations of all the harts, from the first start to the last end */
+	spinlock_t lock;
+	u64 ops, start, end;
+};
+
+// every hart does HARTS_OPS operations at a time until the time is up
+static void harts_main(u32 hartid, void *arg)
+{
+	struct harts_bench *b = arg;
+	u64 limit	      = host_bench_seconds() * 1e9;
+	u64 ops		      = 0;
+
+	if (b->setup)
+		b->setup(hartid);
+	u64 start = host_time_ns(), end = start;
+	while (end - start < limit) {
+		b->run(hartid);
+		ops += HARTS_OPS;
+		end = host_time_ns();
+	}
+	if (b->check)
+		b->check(hartid, ops);
+
+	spin_lock(&b->lock);
+	b->ops += ops;
+	if (!b->start || start < b->start)
+		b->start = start;
+	if (end > b->end)
+		b->end = end;
+	spin_unlock(&b->lock);
+}
+
+/*
+ * Report the operations of all the harts together: with no contention
+ * ops/s grows with the harts, as far as the host has CPUs for them.
+ */
+static void bench_harts(const char *const names[], struct harts_bench *b)
+{
+	static const u32 harts[] = { 1, 2, 4, HOST_HARTS };
+
+	for (int i = 0; i < array_size(harts); i++) {
+		SPIN_LOCK_INIT(b->lock);
+		b->ops	 = 0;
+		b->start = 0;
+		b->end	 = 0;
+		host_run_harts(harts[i], harts_main, b);
+		report(names[i], b->end - b->start, b->ops);
+	}
+	host_set_hart(0);
+}
+
+// event_idx of a firmware event: type in bits [19:16], code below
+#define FW_EVENT_IDX(code) ((SBI_PMU_EVENT_TYPE_FW << 16) | (code))
+
+static int fw_cidx[HOST_HARTS];
+
+static void fw_setup(u32 hartid)
+{
+	unsigned long num_hw = sbi_pmu_num_ctr() - SBI_PMU_FW_CTR_MAX;
+	unsigned long fw_mask = ((1UL << SBI_PMU_FW_CTR_MAX) - 1) << num_hw;
+
+	TEST_ASSERT(sbi_pmu_init(sbi_scratch_thishart_ptr(), false) == 0);
+	fw_cidx[hartid] = sbi_pmu_ctr_cfg_match(
+		0, fw_mask, SBI_PMU_CFG_FLAG_AUTO_START,
+		FW_EVENT_IDX(SBI_PMU_FW_ILLEGAL_INSN), 0);
+	TEST_ASSERT(fw_cidx[hartid] >= num_hw);
+}
+
+static void fw_run(u32 hartid)
+{
+	for (int i = 0; i < HARTS_OPS; i++)
+		sbi_pmu_ctr_incr_fw(SBI_PMU_FW_ILLEGAL_INSN);
+}
+
+static void fw_check(u32 hartid, u64 ops)
+{
+	uint64_t val;
+
+	TEST_ASSERT(sbi_pmu_ctr_fw_read(fw_cidx[hartid], &val) == 0);
+	TEST_ASSERT(val == ops);
+}
+
+#define HARTS_VMID 6
+
+static struct sbi_trap_regs harts_regs[HOST_HARTS];
+
+// hart i runs vCPU i, all of the same VM
+static void ws_run(u32 hartid)
+{
+	for (int i = 0; i < HARTS_OPS; i++)
+		TEST_ASSERT(ws_round_trip(HARTS_VMID, hartid, WS_ECALL,
+					  &harts_regs[hartid]) == 0);
+}
+
+static void bench_contention(void)
+{
+	static const char *const fw_names[] = {
+		"fw counter increment, 1 hart",
+		"fw counter increment, 2 harts",
+		"fw counter increment, 4 harts",
+		"fw counter increment, 8 harts",
+	};
+	static const char *const ws_names[] = {
+		"world switch ecall, 1 hart",
+		"world switch ecall, 2 harts",
+		"world switch ecall, 4 harts",
+		"world switch ecall, 8 harts",
+	};
+	struct harts_bench fw = { .setup = fw_setup,
+				  .run	 = fw_run,
+				  .check = fw_check };
+	struct harts_bench ws = { .run = ws_run };
+
+	TEST_ASSERT(sbi_pmu_init(sbi_scratch_thishart_ptr(), true) == 0);
+	bench_harts(fw_names, &fw);
+
+	ws_vm_create(HARTS_VMID);
+	for (u32 i = 0; i < HOST_HARTS; i++)
+		ws_vcpu_create(HARTS_VMID, i, &harts_regs[i]);
+	bench_harts(ws_names, &ws);
+	TEST_ASSERT(sm_destroy_vm(HARTS_VMID) == 0);
+}
+
+int main(void)
+{
+	host_init();
+	hpt_area_alloc(&hpt, 1, 4, BENCH_PTE_PAGES, BENCH_DRAM_PAGES);
+
+	bench_set_pte();
+	bench_ranges();
+	bench_unmap();
+	bench_chains();
+	bench_monitor_init();
+	bench_world_switch();
+	bench_contention();
+	return 0;
+}
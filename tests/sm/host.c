@@ -0,0 +1,316 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * SBI side of the host build: CSRs, atomics, locks, scratch areas and the
+ * platform services used by the SM.
+ */
+
+#include "host.h"
+#include <sbi/riscv_asm.h>
+#include <sbi/riscv_atomic.h>
+#include <sbi/riscv_barrier.h>
+#include <sbi/riscv_encoding.h>
+#include <sbi/riscv_locks.h>
+#include <sbi/sbi_bitops.h>
+#include <sbi/sbi_hart.h>
+#include <sbi/sbi_ipi.h>
+#include <sbi/sbi_platform.h>
+#include <sbi/sbi_pmp.h>
+#include <sbi/sbi_scratch.h>
+#include <sbi/sbi_string.h>
+#include <sbi/sbi_tvm.h>
+#include <sbi/sbi_unpriv.h>
+#include <sm/bitmap.h>
+
+#define HOST_CSRS 4096
+
+static __thread unsigned long host_csrs[HOST_CSRS];
+__thread unsigned long host_csr_reads, host_csr_writes;
+
+static u8 host_scratch[HOST_HARTS][SBI_SCRATCH_SIZE] __aligned(PAGE_SIZE);
+
+u64 host_tlbr_flush_limit = SBI_PLATFORM_TLB_RANGE_FLUSH_LIMIT_DEFAULT;
+
+static u64 host_get_tlbr_flush_limit(void)
+{
+	return host_tlbr_flush_limit;
+}
+
+static const struct sbi_platform_operations host_platform_ops = {
+	.get_tlbr_flush_limit = host_get_tlbr_flush_limit,
+};
+
+static const struct sbi_platform host_platform = {
+	.name		   = "host",
+	.hart_count	   = HOST_HARTS,
+	.platform_ops_addr = (unsigned long)&host_platform_ops,
+};
+
+unsigned long host_tlb_requests;
+struct sbi_tlb_info host_last_tlb;
+
+void host_set_hart(u32 hartid)
+{
+	struct sbi_scratch *scratch = (struct sbi_scratch *)host_scratch[hartid];
+	struct sm_world_switch *ws  = &scratch->world_switch;
+
+	sbi_memset(host_csrs, 0, sizeof(host_csrs));
+	host_csrs[CSR_MHARTID]	= hartid;
+	host_csrs[CSR_MSCRATCH] = (unsigned long)scratch;
+
+	// the delegation of delegate_traps
+	host_csrs[CSR_MIDELEG] = MIP_SSIP | MIP_STIP | MIP_SEIP;
+	ws->host_mideleg       = host_csrs[CSR_MIDELEG];
+	ws->host_medeleg       = 0;
+	ws->mideleg	       = ws->host_mideleg;
+	ws->medeleg	       = ws->host_medeleg;
+
+	host_csr_reads	= 0;
+	host_csr_writes = 0;
+}
+
+void host_init(void)
+{
+	sbi_memset(host_scratch, 0, sizeof(host_scratch));
+	for (u32 i = 0; i < HOST_HARTS; i++) {
+		struct sbi_scratch *scratch = (struct sbi_scratch *)host_scratch[i];
+		scratch->platform_addr	    = (unsigned long)&host_platform;
+		hartid_to_scratch_table[i]  = scratch;
+	}
+	last_hartid_having_scratch = HOST_HARTS - 1;
+	host_map_fixed(DRAM_BASE, HOST_DRAM_PAGES * PAGE_SIZE);
+	host_set_hart(0);
+}
+
+/* CSRs */
+
+void host_csr_poke(int csr, unsigned long val)
+{
+	host_csrs[csr] = val;
+}
+
+unsigned long sm_host_csr_read(int csr)
+{
+	host_csr_reads++;
+	return host_csrs[csr];
+}
+
+unsigned long sm_host_csr_swap(int csr, unsigned long val)
+{
+	unsigned long old = host_csrs[csr];
+
+	host_csr_writes++;
+	host_csrs[csr] = val;
+	return old;
+}
+
+unsigned long sm_host_csr_read_set(int csr, unsigned long val)
+{
+	unsigned long old = host_csrs[csr];
+
+	host_csr_writes++;
+	host_csrs[csr] = old | val;
+	return old;
+}
+
+unsigned long sm_host_csr_read_clear(int csr, unsigned long val)
+{
+	unsigned long old = host_csrs[csr];
+
+	host_csr_writes++;
+	host_csrs[csr] = old & ~val;
+	return old;
+}
+
+unsigned long csr_read_num(int csr_num)
+{
+	return sm_host_csr_read(csr_num);
+}
+
+void csr_write_num(int csr_num, unsigned long val)
+{
+	sm_host_csr_swap(csr_num, val);
+}
+
+/* Atomics, as lib/sbi/riscv_atomic.c */
+
+long atomic_read(atomic_t *atom)
+{
+	return __atomic_load_n(&atom->counter, __ATOMIC_SEQ_CST);
+}
+
+void atomic_write(atomic_t *atom, long value)
+{
+	__atomic_store_n(&atom->counter, value, __ATOMIC_SEQ_CST);
+}
+
+long atomic_add_return(atomic_t *atom, long value)
+{
+	return __atomic_add_fetch(&atom->counter, value, __ATOMIC_SEQ_CST);
+}
+
+long atomic_sub_return(atomic_t *atom, long value)
+{
+	return __atomic_sub_fetch(&atom->counter, value, __ATOMIC_SEQ_CST);
+}
+
+long atomic_cmpxchg(atomic_t *atom, long oldval, long newval)
+{
+	__atomic_compare_exchange_n(&atom->counter, &oldval, newval, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return oldval;
+}
+
+long atomic_xchg(atomic_t *atom, long newval)
+{
+	return __atomic_exchange_n(&atom->counter, newval, __ATOMIC_SEQ_CST);
+}
+
+unsigned int atomic_raw_xchg_uint(volatile unsigned int *ptr,
+				  unsigned int newval)
+{
+	return __atomic_exchange_n(ptr, newval, __ATOMIC_SEQ_CST);
+}
+
+unsigned long atomic_raw_xchg_ulong(volatile unsigned long *ptr,
+				    unsigned long newval)
+{
+	return __atomic_exchange_n(ptr, newval, __ATOMIC_SEQ_CST);
+}
+
+int atomic_raw_set_bit(int nr, volatile unsigned long *addr)
+{
+	unsigned long mask = 1UL << (nr % BITS_PER_LONG);
+
+	addr += nr / BITS_PER_LONG;
+	return (__atomic_fetch_or(addr, mask, __ATOMIC_SEQ_CST) & mask) != 0;
+}
+
+int atomic_raw_clear_bit(int nr, volatile unsigned long *addr)
+{
+	unsigned long mask = 1UL << (nr % BITS_PER_LONG);
+
+	addr += nr / BITS_PER_LONG;
+	return (__atomic_fetch_and(addr, ~mask, __ATOMIC_SEQ_CST) & mask) != 0;
+}
+
+int atomic_set_bit(int nr, atomic_t *atom)
+{
+	return atomic_raw_set_bit(nr, (unsigned long *)&atom->counter);
+}
+
+int atomic_clear_bit(int nr, atomic_t *atom)
+{
+	return atomic_raw_clear_bit(nr, (unsigned long *)&atom->counter);
+}
+
+/* Ticket locks, as lib/sbi/riscv_locks.c */
+
+static inline u32 *lock_word(spinlock_t *lock)
+{
+	return (u32 *)lock;
+}
+
+bool spin_lock_check(spinlock_t *lock)
+{
+	u32 l = __atomic_load_n(lock_word(lock), __ATOMIC_ACQUIRE);
+
+	return (l & 0xffff) != (l >> TICKET_SHIFT);
+}
+
+bool spin_trylock(spinlock_t *lock)
+{
+	u32 l = __atomic_load_n(lock_word(lock), __ATOMIC_RELAXED);
+
+	if ((l & 0xffff) != (l >> TICKET_SHIFT))
+		return false;
+	return __atomic_compare_exchange_n(lock_word(lock), &l,
+					   l + (1U << TICKET_SHIFT), false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void spin_lock(spinlock_t *lock)
+{
+	u32 l	   = __atomic_fetch_add(lock_word(lock), 1U << TICKET_SHIFT,
+					__ATOMIC_ACQ_REL);
+	u16 ticket = l >> TICKET_SHIFT;
+
+	while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+		cpu_relax();
+}
+
+void spin_unlock(spinlock_t *lock)
+{
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+/* Platform services */
+
+u32 sbi_platform_hart_index(const struct sbi_platform *plat, u32 hartid)
+{
+	return hartid;
+}
+
+int set_pmp_and_sync(unsigned int n, unsigned long prot, unsigned long addr,
+		     unsigned long log2len)
+{
+	return 0;
+}
+
+int set_tvm_and_sync()
+{
+	return 0;
+}
+
+int sbi_ipi_event_create(const struct sbi_ipi_event_ops *ops)
+{
+	return 0;
+}
+
+int sbi_ipi_send_many(ulong hmask, ulong hbase, u32 event, void *data)
+{
+	return 0;
+}
+
+void sbi_tlb_local_sfence_vma(struct sbi_tlb_info *tinfo)
+{
+}
+
+int sbi_tlb_request(ulong hmask, ulong hbase, struct sbi_tlb_info *tinfo)
+{
+	__atomic_add_fetch(&host_tlb_requests, 1, __ATOMIC_RELAXED);
+	host_last_tlb = *tinfo;
+	return 0;
+}
+
+ulong sbi_get_insn(ulong mepc, struct sbi_trap_info *trap)
+{
+	return 0;
+}
+
+bool sbi_hart_has_extension(struct sbi_scratch *scratch,
+			    enum sbi_hart_extensions ext)
+{
+	return false;
+}
+
+// no hardware counters besides mcycle and minstret
+unsigned int sbi_hart_mhpm_count(struct sbi_scratch *scratch)
+{
+	return 0;
+}
+
+unsigned int sbi_hart_mhpm_bits(struct sbi_scratch *scratch)
+{
+	return 0;
+}
+
+int sbi_hart_priv_version(struct sbi_scratch *scratch)
+{
+	return SBI_HART_PRIV_VER_1_12;
+}
+
+void __noreturn sbi_hart_hang(void)
+{
+	host_fail("sbi_hart_hang()", __FILE__, __LINE__);
+}
@@ -0,0 +1,77 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Host (x86 Linux) build of the SM memory code: harts are threads, the
+ * CSRs of a hart are a per-thread array and the platform services the SM
+ * calls are stubs. Only the SBI headers are included here, the libc side
+ * lives in host_libc.c.
+ */
+
+#ifndef __SM_HOST_H__
+#define __SM_HOST_H__
+
+#include <sbi/sbi_types.h>
+#include <sbi/sbi_tlb.h>
+
+/** Harts with a scratch area, hart 0 is the main thread */
+#define HOST_HARTS 8
+
+/**
+ * Pages of real memory at DRAM_BASE, for what the SM dereferences and the
+ * bitmap has to cover (run pages). The rest of the DRAM is only pfns.
+ */
+#define HOST_DRAM_PAGES 1024
+
+/**
+ * Set up the scratch areas and the DRAM window, and make the calling
+ * thread hart 0
+ */
+void host_init(void);
+
+/** Make the calling thread the hart, with its own CSRs */
+void host_set_hart(u32 hartid);
+
+/**
+ * Run fn on harts [0, num) at the same time, one thread per hart, and
+ * wait for all of them
+ */
+void host_run_harts(u32 num, void (*fn)(u32 hartid, void *arg), void *arg);
+
+/** Page aligned, zeroed memory, never freed */
+void *host_alloc(size_t size);
+
+/** Zeroed memory at a fixed address, never freed */
+void *host_map_fixed(uintptr_t addr, size_t size);
+
+/** Monotonic time in nanoseconds */
+u64 host_time_ns(void);
+
+/** Print to stdout, unlike sbi_printf which is quiet unless SM_HOST_VERBOSE */
+void host_printf(const char *format, ...)
+	__attribute__((format(printf, 1, 2)));
+
+/** Seconds each benchmark runs for, SM_BENCH_SECONDS (default 0.2) */
+double host_bench_seconds(void);
+
+void __noreturn host_fail(const char *expr, const char *file, int line);
+
+#define TEST_ASSERT(x)                                        \
+	do {                                                  \
+		if (!(x))                                     \
+			host_fail(#x, __FILE__, __LINE__);    \
+	} while (0)
+
+/** Set a CSR of the calling hart as the host would, without counting it */
+void host_csr_poke(int csr, unsigned long val);
+
+/** CSR accesses of the calling hart since it was set up */
+extern __thread unsigned long host_csr_reads, host_csr_writes;
+
+/** Range flushes beyond this become full flushes (get_tlbr_flush_limit) */
+extern u64 host_tlbr_flush_limit;
+
+/** Calls of sbi_tlb_request, and the last request */
+extern unsigned long host_tlb_requests;
+extern struct sbi_tlb_info host_last_tlb;
+
+#endif
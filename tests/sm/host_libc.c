@@ -0,0 +1,150 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * libc side of the host build: console, memory, time and threads. The SBI
+ * headers redefine the C types, so they are not included here.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+void host_set_hart(unsigned int hartid);
+
+static int host_verbose(void)
+{
+	static int verbose = -1;
+
+	if (verbose < 0)
+		verbose = getenv("SM_HOST_VERBOSE") != NULL;
+	return verbose;
+}
+
+int sbi_printf(const char *format, ...)
+{
+	va_list ap;
+	int ret = 0;
+
+	if (host_verbose()) {
+		va_start(ap, format);
+		ret = vprintf(format, ap);
+		va_end(ap);
+	}
+	return ret;
+}
+
+int sbi_dprintf(const char *format, ...)
+{
+	return 0;
+}
+
+void sbi_panic(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	abort();
+}
+
+void host_printf(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vprintf(format, ap);
+	va_end(ap);
+	fflush(stdout);
+}
+
+void host_fail(const char *expr, const char *file, int line)
+{
+	fprintf(stderr, "%s:%d: assertion failed: %s\n", file, line, expr);
+	abort();
+}
+
+void *host_alloc(size_t size)
+{
+	size	  = (size + 4095) & ~(size_t)4095;
+	void *ptr = aligned_alloc(4096, size);
+
+	if (!ptr) {
+		fprintf(stderr, "host_alloc: out of memory (%zu bytes)\n", size);
+		abort();
+	}
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void *host_map_fixed(unsigned long addr, unsigned long size)
+{
+	void *ptr = mmap((void *)addr, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+	if (ptr != (void *)addr) {
+		fprintf(stderr, "host_map_fixed: cannot map 0x%lx\n", addr);
+		abort();
+	}
+	return ptr;
+}
+
+unsigned long long host_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+double host_bench_seconds(void)
+{
+	const char *s = getenv("SM_BENCH_SECONDS");
+
+	return s ? atof(s) : 0.2;
+}
+
+struct host_hart {
+	pthread_t thread;
+	unsigned int hartid;
+	void (*fn)(unsigned int hartid, void *arg);
+	void *arg;
+	pthread_barrier_t *start;
+};
+
+static void *host_hart_main(void *data)
+{
+	struct host_hart *hart = data;
+
+	host_set_hart(hart->hartid);
+	pthread_barrier_wait(hart->start);
+	hart->fn(hart->hartid, hart->arg);
+	return NULL;
+}
+
+void host_run_harts(unsigned int num,
+		    void (*fn)(unsigned int hartid, void *arg), void *arg)
+{
+	struct host_hart harts[num];
+	pthread_barrier_t start;
+
+	pthread_barrier_init(&start, NULL, num);
+	for (unsigned int i = 0; i < num; i++) {
+		harts[i] = (struct host_hart){ .hartid = i,
+					       .fn     = fn,
+					       .arg    = arg,
+					       .start  = &start };
+		if (pthread_create(&harts[i].thread, NULL, host_hart_main,
+				   &harts[i])) {
+			fprintf(stderr, "host_run_harts: pthread_create failed\n");
+			abort();
+		}
+	}
+	for (unsigned int i = 0; i < num; i++)
+		pthread_join(harts[i].thread, NULL);
+	pthread_barrier_destroy(&start);
+}
@@ -0,0 +1,131 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Synthetic HPT Area for the host build.
+ */
+
+#include "host.h"
+#include "hpt.h"
+#include <sbi/sbi_ecall_interface.h>
+#include <sbi/sbi_string.h>
+#include <sm/sm.h>
+
+// page metadata (16 words) and a 16-bit counter per 2MB, a 32-bit one per 1GB
+static uint64_t hpt_bitmap_size(uint64_t dram_pages)
+{
+	uint64_t pmd_regions = (dram_pages + 511) / 512;
+	uint64_t size	     = pmd_regions * (16 * sizeof(u64) + sizeof(u16)) +
+			   ((pmd_regions + 511) / 512) * sizeof(u32);
+	return ROUNDUP(size, sizeof(u64));
+}
+
+void hpt_area_alloc(struct hpt_area *hpt, unsigned long pgd_pages,
+		    unsigned long pmd_pages, unsigned long pte_pages,
+		    uint64_t dram_pages)
+{
+	unsigned long pages = pgd_pages + pmd_pages + pte_pages;
+
+	sbi_memset(hpt, 0, sizeof(*hpt));
+	hpt->pgd       = host_alloc(pages * PAGE_SIZE);
+	hpt->pmd       = hpt->pgd + pgd_pages * HPT_ENTRIES;
+	hpt->pte       = hpt->pmd + pmd_pages * HPT_ENTRIES;
+	hpt->pgd_pages = pgd_pages;
+	hpt->pmd_pages = pmd_pages;
+	hpt->pte_pages = pte_pages;
+
+	hpt->dram_pages	 = dram_pages;
+	hpt->bitmap_size = hpt_bitmap_size(dram_pages);
+	hpt->bitmap	 = host_alloc(hpt->bitmap_size);
+
+	/*
+	 * With the reverse map: buckets and node index of the HPT Area size,
+	 * 16 bytes per HPT page and a 40-byte node per entry. Without it:
+	 * 40 bytes per HPT page.
+	 */
+	hpt->reverse_map_size = pages * PAGE_SIZE * 8;
+	hpt->reverse_map      = host_alloc(hpt->reverse_map_size);
+}
+
+int hpt_area_reset(struct hpt_area *hpt)
+{
+	unsigned long pages = hpt->pgd_pages + hpt->pmd_pages + hpt->pte_pages;
+	uintptr_t mstatus;
+	int r;
+
+	sbi_memset(hpt->pgd, 0, pages * PAGE_SIZE);
+	hpt->pmd_used = 0;
+	hpt->pte_used = 0;
+
+	r = bitmap_and_hpt_init((uintptr_t)hpt->bitmap, hpt->bitmap_size,
+				(uintptr_t)hpt->pgd, pages * PAGE_SIZE,
+				(uintptr_t)hpt->pmd, (uintptr_t)hpt->pte);
+	if (r)
+		return r;
+	r = sm_reverse_map_init((uintptr_t)hpt->reverse_map,
+				hpt->reverse_map_size);
+	if (r)
+		return r;
+	return monitor_init(&mstatus);
+}
+
+static int hpt_set(uintptr_t *entry, uintptr_t pte)
+{
+	return sm_set_pte(SBI_EXT_SM_SET_PTE_SET_ONE, (unsigned long *)entry,
+			  pte, 0, NULL, NULL);
+}
+
+// the table an entry points to, allocated from the section if missing
+static uintptr_t *hpt_next(struct hpt_area *hpt, uintptr_t *entry, bool alloc,
+			   bool pmd)
+{
+	if (*entry & PTE_V) {
+		if (*entry & (PTE_R | PTE_W | PTE_X))
+			return NULL;
+		return (uintptr_t *)((*entry >> PTE_PPN_SHIFT) << PAGE_SHIFT);
+	}
+	if (!alloc)
+		return NULL;
+
+	uintptr_t *table;
+	if (pmd) {
+		if (hpt->pmd_used == hpt->pmd_pages)
+			return NULL;
+		table = hpt->pmd + hpt->pmd_used++ * HPT_ENTRIES;
+	} else {
+		if (hpt->pte_used == hpt->pte_pages)
+			return NULL;
+		table = hpt->pte + hpt->pte_used++ * HPT_ENTRIES;
+	}
+	if (hpt_set(entry, HPT_TABLE(table)))
+		return NULL;
+	return table;
+}
+
+uintptr_t *hpt_entry(struct hpt_area *hpt, unsigned long root, uintptr_t va,
+		     int level, bool alloc)
+{
+	uintptr_t *entry = hpt->pgd + root * HPT_ENTRIES + ((va >> 30) & 511);
+	if (level == HPT_1G)
+		return entry;
+
+	uintptr_t *table = hpt_next(hpt, entry, alloc, true);
+	if (!table)
+		return NULL;
+	entry = table + ((va >> 21) & 511);
+	if (level == HPT_2M)
+		return entry;
+
+	table = hpt_next(hpt, entry, alloc, false);
+	if (!table)
+		return NULL;
+	return table + ((va >> PAGE_SHIFT) & 511);
+}
+
+int hpt_map(struct hpt_area *hpt, unsigned long root, uintptr_t va,
+	    uint64_t pfn, int level)
+{
+	uintptr_t *entry = hpt_entry(hpt, root, va, level, true);
+	if (!entry)
+		return -1;
+	return hpt_set(entry, HPT_LEAF(pfn));
+}
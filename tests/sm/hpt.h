@@ -0,0 +1,88 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Synthetic HPT Area for the host build, laid out as bitmap_and_hpt_init
+ * expects: [PGD section][PMD section][PTE section], page aligned. Host
+ * memory stands for physical memory, so the non-leaf entries hold the
+ * host addresses of the tables. Leaf entries map pfns of a DRAM that only
+ * exists in the bitmap, starting at DRAM_BASE.
+ */
+
+#ifndef __SM_HOST_HPT_H__
+#define __SM_HOST_HPT_H__
+
+#include <sbi/sbi_types.h>
+#include <sbi/riscv_asm.h>
+#include <sbi/riscv_encoding.h>
+#include <sm/bitmap.h>
+
+/** pfn of the page of DRAM */
+#define HPT_DRAM_PFN(page) (((uint64_t)DRAM_BASE >> PAGE_SHIFT) + (page))
+
+/** Leaf entry mapping pfn */
+#define HPT_LEAF(pfn) \
+	(((uintptr_t)(pfn) << PTE_PPN_SHIFT) | PTE_V | PTE_R | PTE_W | PTE_A | PTE_D)
+
+/** Non-leaf entry pointing to the table */
+#define HPT_TABLE(table) \
+	((((uintptr_t)(table) >> PAGE_SHIFT) << PTE_PPN_SHIFT) | PTE_V)
+
+/** Levels of hpt_entry / hpt_map, the size of the page a leaf maps */
+#define HPT_4K 0
+#define HPT_2M 1
+#define HPT_1G 2
+
+#define HPT_ENTRIES (PAGE_SIZE / sizeof(uintptr_t))
+
+struct hpt_area {
+	/** Sections, pgd_pages page-table roots (one per host address space) */
+	uintptr_t *pgd, *pmd, *pte;
+	unsigned long pgd_pages, pmd_pages, pte_pages;
+	/** Table pages handed out by hpt_entry */
+	unsigned long pmd_used, pte_used;
+	/** Bitmap, covering dram_pages pages from DRAM_BASE */
+	void *bitmap;
+	uint64_t bitmap_size, dram_pages;
+	/** Reverse map, sized for either configuration */
+	void *reverse_map;
+	uint64_t reverse_map_size;
+};
+
+/**
+ * Allocate the memory of a synthetic HPT Area
+ *
+ * @param hpt the area
+ * @param pgd_pages / pmd_pages / pte_pages the pages of each section
+ * @param dram_pages the pages of DRAM the bitmap covers
+ */
+void hpt_area_alloc(struct hpt_area *hpt, unsigned long pgd_pages,
+		    unsigned long pmd_pages, unsigned long pte_pages,
+		    uint64_t dram_pages);
+
+/**
+ * Empty the page tables and bring the SM up on them:
+ * bitmap_and_hpt_init, sm_reverse_map_init and monitor_init
+ *
+ * @return 0 on success, negative error code on failure
+ */
+int hpt_area_reset(struct hpt_area *hpt);
+
+/**
+ * The entry of a level for a host virtual address, Sv39
+ *
+ * @param root the page-table root, index of a page of the PGD section
+ * @param alloc link new table pages through sm_set_pte where missing
+ * @return the address of the entry, NULL if a table is missing or full
+ */
+uintptr_t *hpt_entry(struct hpt_area *hpt, unsigned long root, uintptr_t va,
+		     int level, bool alloc);
+
+/**
+ * Map va to pfn with a leaf of the level, through sm_set_pte
+ *
+ * @return 0 on success, negative error code on failure
+ */
+int hpt_map(struct hpt_area *hpt, unsigned long root, uintptr_t va,
+	    uint64_t pfn, int level);
+
+#endif
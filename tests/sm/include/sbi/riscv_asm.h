@@ -0,0 +1,42 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Host build of the SM: the CSR accessors go to a per-thread CSR file
+ * in host.c instead of csrr/csrw.
+ */
+
+#ifndef __SM_HOST_RISCV_ASM_H__
+#define __SM_HOST_RISCV_ASM_H__
+
+#include_next <sbi/riscv_asm.h>
+
+#ifndef __ASSEMBLER__
+
+unsigned long sm_host_csr_read(int csr);
+unsigned long sm_host_csr_swap(int csr, unsigned long val);
+unsigned long sm_host_csr_read_set(int csr, unsigned long val);
+unsigned long sm_host_csr_read_clear(int csr, unsigned long val);
+
+#undef csr_swap
+#undef csr_read
+#undef csr_write
+#undef csr_read_set
+#undef csr_set
+#undef csr_read_clear
+#undef csr_clear
+#undef wfi
+#undef ebreak
+
+#define csr_swap(csr, val)	sm_host_csr_swap(csr, (unsigned long)(val))
+#define csr_read(csr)		sm_host_csr_read(csr)
+#define csr_write(csr, val)	((void)sm_host_csr_swap(csr, (unsigned long)(val)))
+#define csr_read_set(csr, val)	sm_host_csr_read_set(csr, (unsigned long)(val))
+#define csr_set(csr, val)	((void)sm_host_csr_read_set(csr, (unsigned long)(val)))
+#define csr_read_clear(csr, val) sm_host_csr_read_clear(csr, (unsigned long)(val))
+#define csr_clear(csr, val)	((void)sm_host_csr_read_clear(csr, (unsigned long)(val)))
+#define wfi()			do { } while (0)
+#define ebreak()		do { } while (0)
+
+#endif /* !__ASSEMBLER__ */
+
+#endif
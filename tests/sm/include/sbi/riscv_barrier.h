@@ -0,0 +1,38 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Host build of the SM: RISC-V fences become compiler/host fences.
+ */
+
+#ifndef __RISCV_BARRIER_H__
+#define __RISCV_BARRIER_H__
+
+/* clang-format off */
+
+#define RISCV_FENCE(p, s)	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define RISCV_FENCE_I		__atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+#define mb()			RISCV_FENCE(iorw,iorw)
+#define rmb()			RISCV_FENCE(ir,ir)
+#define wmb()			RISCV_FENCE(ow,ow)
+#define smp_mb()		RISCV_FENCE(rw,rw)
+#define smp_rmb()		RISCV_FENCE(r,r)
+#define smp_wmb()		RISCV_FENCE(w,w)
+#define cpu_relax()		asm volatile ("pause" : : : "memory")
+
+/* clang-format on */
+
+#define __smp_store_release(p, v)   \
+	do {                        \
+		RISCV_FENCE(rw, w); \
+		*(p) = (v);         \
+	} while (0)
+
+#define __smp_load_acquire(p)            \
+	({                               \
+		typeof(*p) ___p1 = *(p); \
+		RISCV_FENCE(r, rw);      \
+		___p1;                   \
+	})
+
+#endif
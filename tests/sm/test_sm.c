@@ -0,0 +1,610 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Tests of the SM memory structures: bitmap, reverse map / HPT Area scan,
+ * sm_set_pte, monitor_init, sm_set_private_memory, the vCPU registry and
+ * the world switch.
+ */
+
+#include "host.h"
+#include "hpt.h"
+#include "world_switch.h"
+#include <sbi/riscv_asm.h>
+#include <sbi/riscv_encoding.h>
+#include <sbi/sbi_ecall_interface.h>
+#include <sbi/sbi_platform.h>
+#include <sbi/sbi_scratch.h>
+#include <sbi/sbi_string.h>
+#include <sbi/sbi_trap.h>
+#include <sm/bitmap.h>
+#include <sm/reverse_map.h>
+#include <sm/sm.h>
+
+struct vcpu_state *get_vcpu_state(unsigned long vm_id, uint64_t cpu_id);
+
+// 4GB of DRAM, so that 1GB leaves fit
+#define TEST_DRAM_PAGES (1UL << 20)
+
+static struct hpt_area hpt;
+
+static void reset(void)
+{
+	TEST_ASSERT(hpt_area_reset(&hpt) == 0);
+	host_tlbr_flush_limit = 1UL << 40;
+}
+
+static unsigned long rand_state = 1;
+
+static unsigned long rand_next(void)
+{
+	rand_state = rand_state * 6364136223846793005UL + 1442695040888963407UL;
+	return rand_state >> 17;
+}
+
+static bool entry_valid(uintptr_t *entry)
+{
+	return *entry & PTE_V;
+}
+
+/* bitmap */
+
+#define REF_PAGES (1UL << 20)
+#define REF_PUBLIC 0
+#define REF_PRIVATE 1
+#define REF_SHARED 2
+
+static bool ref_contains_private(const u8 *ref, uint64_t start, uint64_t num)
+{
+	for (uint64_t i = start; i < start + num; i++) {
+		if (ref[i] == REF_PRIVATE)
+			return true;
+	}
+	return false;
+}
+
+// random conversions and queries against a byte per page
+static void test_bitmap_random(void)
+{
+	u8 *ref = host_alloc(REF_PAGES);
+
+	reset();
+	for (int op = 0; op < 2000; op++) {
+		unsigned long r = rand_next() % 100;
+		uint64_t max	= r < 70 ? 1024 : (r < 95 ? 1UL << 14 : 1UL << 19);
+		uint64_t num	= 1 + rand_next() % max;
+		uint64_t start	= rand_next() % (REF_PAGES - num);
+		int kind	= rand_next() % 3;
+
+		switch (kind) {
+		case REF_PUBLIC:
+			TEST_ASSERT(set_public_range(HPT_DRAM_PFN(start), num) == 0);
+			break;
+		case REF_PRIVATE:
+			TEST_ASSERT(set_private_range(HPT_DRAM_PFN(start), num) == 0);
+			break;
+		default:
+			TEST_ASSERT(set_shared_range(HPT_DRAM_PFN(start), num) == 0);
+			break;
+		}
+		sbi_memset(&ref[start], kind, num);
+
+		for (int q = 0; q < 4; q++) {
+			r     = rand_next() % 100;
+			max   = r < 70 ? 1024 : (r < 95 ? 1UL << 14 : 1UL << 19);
+			num   = 1 + rand_next() % max;
+			start = rand_next() % (REF_PAGES - num);
+			bool private = ref_contains_private(ref, start, num);
+			TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(start),
+							  num) == private);
+			TEST_ASSERT(test_public_shared_range(HPT_DRAM_PFN(start),
+							     num) == !private);
+		}
+	}
+}
+
+// huge ranges are answered by the 2MB/1GB counters
+static void test_bitmap_counters(void)
+{
+	uint64_t gb = 1UL << 18, mb2 = 512;
+
+	reset();
+	TEST_ASSERT(set_private_range(HPT_DRAM_PFN(gb + 1000), 1) == 0);
+	TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(gb), gb) == 1);
+	TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(0), gb) == 0);
+	TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(2 * gb), gb) == 0);
+	TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(gb + 1000 - 1000 % mb2),
+					  mb2) == 1);
+	TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(gb), 1000) == 0);
+
+	// a whole 2MB region, then back to shared page by page
+	TEST_ASSERT(set_private_range(HPT_DRAM_PFN(3 * mb2), mb2) == 0);
+	TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(0), gb) == 1);
+	for (uint64_t i = 0; i < mb2; i++)
+		TEST_ASSERT(set_shared_range(HPT_DRAM_PFN(3 * mb2 + i), 1) == 0);
+	TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(0), gb) == 0);
+
+	TEST_ASSERT(set_public_range(HPT_DRAM_PFN(gb), gb) == 0);
+	TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(0), TEST_DRAM_PAGES) == 0);
+}
+
+static void test_bitmap_bounds(void)
+{
+	reset();
+	TEST_ASSERT(set_private_range(HPT_DRAM_PFN(0) - 1, 1) < 0);
+	TEST_ASSERT(set_private_range(HPT_DRAM_PFN(TEST_DRAM_PAGES - 1), 2) < 0);
+	TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(TEST_DRAM_PAGES), 1) < 0);
+	TEST_ASSERT(set_private_range(HPT_DRAM_PFN(TEST_DRAM_PAGES - 1), 1) == 0);
+	TEST_ASSERT(contain_private_range(HPT_DRAM_PFN(TEST_DRAM_PAGES - 1), 1) ==
+		    1);
+}
+
+/* sm_set_pte and unmap_range */
+
+static void test_set_pte_single(void)
+{
+	uint64_t pfn = HPT_DRAM_PFN(100);
+
+	reset();
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x1000, pfn, HPT_4K) == 0);
+	uintptr_t *entry = hpt_entry(&hpt, 0, 0x1000, HPT_4K, false);
+	TEST_ASSERT(entry && *entry == HPT_LEAF(pfn));
+
+	unsigned long tlbs = host_tlb_requests;
+	TEST_ASSERT(unmap_range(pfn, 1) == 0);
+	TEST_ASSERT(!entry_valid(entry));
+	TEST_ASSERT(unmap_flush_batch() == 0);
+	TEST_ASSERT(host_tlb_requests == tlbs + 1);
+	TEST_ASSERT(host_last_tlb.start == 0x1000 &&
+		    host_last_tlb.size == PAGE_SIZE);
+
+	// nothing left to invalidate or flush
+	TEST_ASSERT(unmap_range(pfn, 1) == 0);
+	TEST_ASSERT(unmap_flush_batch() == 0);
+	TEST_ASSERT(host_tlb_requests == tlbs + 1);
+
+	// an overwritten entry is no longer found by its old pfn
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x1000, pfn, HPT_4K) == 0);
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x1000, pfn + 1, HPT_4K) == 0);
+	TEST_ASSERT(unmap_range(pfn, 1) == 0);
+	TEST_ASSERT(*entry == HPT_LEAF(pfn + 1));
+	TEST_ASSERT(unmap_range(pfn + 1, 1) == 0);
+	TEST_ASSERT(!entry_valid(entry));
+	unmap_flush_batch();
+}
+
+static void test_set_pte_rejects(void)
+{
+	uint64_t pfn = HPT_DRAM_PFN(512 + 7);
+
+	reset();
+	TEST_ASSERT(set_private_range(pfn, 1) == 0);
+
+	// leaves mapping a private page
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x2000, pfn, HPT_4K) < 0);
+	TEST_ASSERT(*hpt_entry(&hpt, 0, 0x2000, HPT_4K, false) == 0);
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x200000, HPT_DRAM_PFN(512), HPT_2M) < 0);
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x2000, pfn + 1, HPT_4K) == 0);
+
+	// entries outside HPT Area
+	unsigned long outside = 0;
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_SET_ONE, &outside,
+			       HPT_LEAF(pfn + 1), 0, NULL, NULL) < 0);
+	TEST_ASSERT(outside == 0);
+	outside = HPT_LEAF(pfn + 1);
+	TEST_ASSERT(set_single_pte(&outside, 0, 0) < 0);
+	TEST_ASSERT(outside == HPT_LEAF(pfn + 1));
+
+	// tables outside their section
+	uintptr_t *pgd = hpt.pgd + 5;
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_SET_ONE, pgd,
+			       HPT_TABLE(hpt.pte), 0, NULL, NULL) < 0);
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_SET_ONE, pgd,
+			       HPT_TABLE(hpt.pgd), 0, NULL, NULL) < 0);
+	TEST_ASSERT(*pgd == 0);
+	uintptr_t *pmd = hpt_entry(&hpt, 0, 0x2000, HPT_2M, false) + 1;
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_SET_ONE, pmd,
+			       HPT_TABLE(hpt.pmd), 0, NULL, NULL) < 0);
+	TEST_ASSERT(*pmd == 0);
+
+	TEST_ASSERT(sm_set_pte(0x55, pgd, 0, 0, NULL, NULL) < 0);
+}
+
+// the PTE page mapping [va, va + 2MB) and its 512 entries
+static uintptr_t *pte_page(uintptr_t va)
+{
+	return hpt_entry(&hpt, 0, va, HPT_4K, true) - ((va >> PAGE_SHIFT) & 511);
+}
+
+static void test_set_pte_memcpy(void)
+{
+	uint64_t pfn = HPT_DRAM_PFN(4096);
+	uintptr_t src[HPT_ENTRIES];
+
+	reset();
+	uintptr_t *table = pte_page(0x400000);
+	for (int i = 0; i < HPT_ENTRIES; i++)
+		src[i] = HPT_LEAF(pfn + i);
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_MEMCPY, table,
+			       (unsigned long)src, sizeof(src), NULL, NULL) == 0);
+	TEST_ASSERT(!sbi_memcmp(table, src, sizeof(src)));
+
+	TEST_ASSERT(unmap_range(pfn + 5, 1) == 0);
+	TEST_ASSERT(!entry_valid(&table[5]) && entry_valid(&table[4]) &&
+		    entry_valid(&table[6]));
+
+	// copied up to the first rejected entry
+	TEST_ASSERT(set_private_range(HPT_DRAM_PFN(1), 1) == 0);
+	src[7]	= HPT_LEAF(HPT_DRAM_PFN(1));
+	src[3]	= HPT_LEAF(pfn + 1000);
+	src[10] = HPT_LEAF(pfn + 1001);
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_MEMCPY, table,
+			       (unsigned long)src, sizeof(src), NULL, NULL) < 0);
+	TEST_ASSERT(table[3] == HPT_LEAF(pfn + 1000));
+	TEST_ASSERT(table[5] == HPT_LEAF(pfn + 5));
+	TEST_ASSERT(table[7] == HPT_LEAF(pfn + 7));
+	TEST_ASSERT(table[10] == HPT_LEAF(pfn + 10));
+
+	// the reverse map follows the copied entries
+	TEST_ASSERT(unmap_range(pfn + 3, 1) == 0);
+	TEST_ASSERT(table[3] == HPT_LEAF(pfn + 1000));
+	TEST_ASSERT(unmap_range(pfn + 1000, 1) == 0);
+	TEST_ASSERT(!entry_valid(&table[3]));
+
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_MEMCPY, table,
+			       (unsigned long)src, 12, NULL, NULL) < 0);
+	unmap_flush_batch();
+}
+
+static void test_set_pte_clear(void)
+{
+	uint64_t pfn = HPT_DRAM_PFN(8192);
+
+	reset();
+	uintptr_t *table = pte_page(0x600000);
+	for (int i = 0; i < HPT_ENTRIES; i++)
+		TEST_ASSERT(hpt_map(&hpt, 0, 0x600000 + i * PAGE_SIZE, pfn + i,
+				    HPT_4K) == 0);
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_CLEAR, table, 0,
+			       PAGE_SIZE, NULL, NULL) == 0);
+	for (int i = 0; i < HPT_ENTRIES; i++)
+		TEST_ASSERT(table[i] == 0);
+
+	// no reverse map left behind
+	unsigned long tlbs = host_tlb_requests;
+	TEST_ASSERT(unmap_range(pfn, HPT_ENTRIES) == 0);
+	TEST_ASSERT(unmap_flush_batch() == 0);
+	TEST_ASSERT(host_tlb_requests == tlbs);
+
+	// an entry outside HPT Area is left alone
+	unsigned long outside = HPT_LEAF(pfn);
+	sm_set_pte(SBI_EXT_SM_SET_PTE_CLEAR, &outside, 0, sizeof(outside),
+		   NULL, NULL);
+	TEST_ASSERT(outside == HPT_LEAF(pfn));
+}
+
+static void test_set_pte_batch(void)
+{
+	uint64_t pfn = HPT_DRAM_PFN(16384);
+	struct sm_pte_update updates[SM_PTE_BATCH_MAX + 1];
+	unsigned long failed, applied;
+
+	reset();
+	uintptr_t *a = hpt_entry(&hpt, 0, 0x800000, HPT_4K, true);
+	uintptr_t *b = hpt_entry(&hpt, 0, 0xa00000, HPT_4K, true);
+	uintptr_t *c = hpt_entry(&hpt, 1, 0x800000, HPT_4K, true);
+	TEST_ASSERT(set_private_range(pfn + 2, 1) == 0);
+
+	// validated as a whole: nothing is written
+	updates[0] = (struct sm_pte_update){ (unsigned long)a, HPT_LEAF(pfn) };
+	updates[1] = (struct sm_pte_update){ (unsigned long)b, HPT_LEAF(pfn + 1) };
+	updates[2] = (struct sm_pte_update){ (unsigned long)c, HPT_LEAF(pfn + 2) };
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_BATCH, (unsigned long *)updates,
+			       0, 3 * sizeof(*updates), &failed, &applied) < 0);
+	TEST_ASSERT(failed == 2 && applied == 0);
+	TEST_ASSERT(*a == 0 && *b == 0 && *c == 0);
+
+	updates[2].pte = HPT_LEAF(pfn + 3);
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_BATCH, (unsigned long *)updates,
+			       0, 3 * sizeof(*updates), &failed, &applied) == 0);
+	TEST_ASSERT(failed == 3 && applied == 3);
+	TEST_ASSERT(*a == HPT_LEAF(pfn) && *b == HPT_LEAF(pfn + 1) &&
+		    *c == HPT_LEAF(pfn + 3));
+
+	TEST_ASSERT(unmap_range(pfn, 4) == 0);
+	TEST_ASSERT(!entry_valid(a) && !entry_valid(b) && !entry_valid(c));
+	unmap_flush_batch();
+
+	// arrays that are cut, misaligned, too long or in SM memory
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_BATCH, (unsigned long *)updates,
+			       0, 3 * sizeof(*updates) - 1, &failed,
+			       &applied) < 0);
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_BATCH,
+			       (unsigned long *)((char *)updates + 4), 0,
+			       sizeof(*updates), &failed, &applied) < 0);
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_BATCH, (unsigned long *)updates,
+			       0, sizeof(updates), &failed, &applied) < 0);
+	sbi_memcpy(hpt.bitmap, updates, sizeof(*updates));
+	TEST_ASSERT(sm_set_pte(SBI_EXT_SM_SET_PTE_BATCH, hpt.bitmap, 0,
+			       sizeof(*updates), &failed, &applied) < 0);
+	TEST_ASSERT(applied == 0 && !entry_valid(a));
+	reset();
+}
+
+static void test_unmap_huge(void)
+{
+	uint64_t pfn = HPT_DRAM_PFN(3 * 512);
+
+	reset();
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x40600000, pfn, HPT_2M) == 0);
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x40800000, pfn + 512, HPT_2M) == 0);
+	uintptr_t *pmd = hpt_entry(&hpt, 0, 0x40600000, HPT_2M, false);
+
+	TEST_ASSERT(unmap_range(pfn + 511, 1) == 0);
+	TEST_ASSERT(!entry_valid(pmd) && entry_valid(pmd + 1));
+	TEST_ASSERT(unmap_flush_batch() == 0);
+	TEST_ASSERT(host_last_tlb.start == 0x40600000 &&
+		    host_last_tlb.size == 0x200000);
+
+	// the default flush limit turns that into a full flush
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x40600000, pfn, HPT_2M) == 0);
+	host_tlbr_flush_limit = SBI_PLATFORM_TLB_RANGE_FLUSH_LIMIT_DEFAULT;
+	TEST_ASSERT(unmap_range(pfn + 100, 1000) == 0);
+	TEST_ASSERT(!entry_valid(pmd) && !entry_valid(pmd + 1));
+	TEST_ASSERT(unmap_flush_batch() == 0);
+	TEST_ASSERT(host_last_tlb.size == SBI_TLB_FLUSH_ALL);
+}
+
+// several unmap_range calls share one shootdown
+static void test_unmap_batch(void)
+{
+	uint64_t pfn = HPT_DRAM_PFN(20000);
+
+	reset();
+	for (int i = 0; i < 3; i++)
+		TEST_ASSERT(hpt_map(&hpt, 0, 0x1000 + 0x2000 * i, pfn + 10 * i,
+				    HPT_4K) == 0);
+	unsigned long tlbs = host_tlb_requests;
+	for (int i = 0; i < 3; i++)
+		TEST_ASSERT(unmap_range(pfn + 10 * i, 1) == 0);
+	TEST_ASSERT(host_tlb_requests == tlbs);
+	TEST_ASSERT(unmap_flush_batch() == 0);
+	TEST_ASSERT(host_tlb_requests == tlbs + 1);
+	TEST_ASSERT(host_last_tlb.start == 0x1000 &&
+		    host_last_tlb.size == 0x5000);
+}
+
+static void test_monitor_init(void)
+{
+	uintptr_t mstatus;
+
+	reset();
+	// a PGD entry may only point into the PMD section
+	hpt.pgd[3] = HPT_TABLE(hpt.pte);
+	TEST_ASSERT(monitor_init(&mstatus) < 0);
+	hpt.pgd[3] = HPT_TABLE(hpt.pmd);
+	TEST_ASSERT(monitor_init(&mstatus) == 0);
+
+	// a non-leaf PMD entry only into the PTE section
+	hpt.pmd[3] = HPT_TABLE(hpt.pmd + HPT_ENTRIES);
+	TEST_ASSERT(monitor_init(&mstatus) < 0);
+	hpt.pmd[3] = HPT_LEAF(HPT_DRAM_PFN(512));
+	TEST_ASSERT(monitor_init(&mstatus) == 0);
+
+	// existing leaves get their reverse map
+	TEST_ASSERT(sm_reverse_map_init((uintptr_t)hpt.reverse_map,
+					hpt.reverse_map_size) == 0);
+	hpt.pte[HPT_ENTRIES + 9] = HPT_LEAF(HPT_DRAM_PFN(77));
+	TEST_ASSERT(monitor_init(&mstatus) == 0);
+	TEST_ASSERT(unmap_range(HPT_DRAM_PFN(77), 1) == 0);
+	TEST_ASSERT(!entry_valid(&hpt.pte[HPT_ENTRIES + 9]));
+	TEST_ASSERT(unmap_range(HPT_DRAM_PFN(512 + 100), 1) == 0);
+	TEST_ASSERT(!entry_valid(&hpt.pmd[3]));
+	unmap_flush_batch();
+}
+
+/* Guests */
+
+#define TEST_VMID 5
+#define TEST_GPA 0x80000000UL
+
+/*
+ * A Sv39x4 G-stage table mapping pages [TEST_GPA, TEST_GPA + 8 pages):
+ * pages 0-3 to pfns[0] + i, pages 4-7 to pfns[1] + i
+ */
+static uintptr_t guest_hgatp(unsigned long vmid, const uint64_t pfns[2])
+{
+	static uintptr_t *root, *l1, *l0;
+
+	if (!root) {
+		root = host_alloc(4 * PAGE_SIZE);
+		l1   = host_alloc(PAGE_SIZE);
+		l0   = host_alloc(PAGE_SIZE);
+	}
+	root[TEST_GPA >> 30]	      = HPT_TABLE(l1);
+	l1[(TEST_GPA >> 21) & 511] = HPT_TABLE(l0);
+	for (int i = 0; i < 8; i++)
+		l0[i] = HPT_LEAF(pfns[i / 4] + i);
+	sm_gpa_cache_flush(0, true);
+
+	return ((uintptr_t)HGATP_MODE_SV39X4 << HGATP64_MODE_SHIFT) |
+	       (vmid << HGATP_VMID_SHIFT) | ((uintptr_t)root >> PAGE_SHIFT);
+}
+
+static void test_private_memory(void)
+{
+	struct sbi_trap_regs regs = { 0 };
+	const uint64_t pfns[2]	  = { HPT_DRAM_PFN(32), HPT_DRAM_PFN(64) };
+	uintptr_t hgatp		  = guest_hgatp(TEST_VMID, pfns);
+
+	reset();
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x1000, pfns[0] + 1, HPT_4K) == 0);
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x2000, pfns[1] + 5, HPT_4K) == 0);
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x3000, pfns[0] + 10, HPT_4K) == 0);
+
+	// a run page inside the region is revoked
+	csr_write(CSR_HGATP, hgatp);
+	TEST_ASSERT(sm_create_cpu(0, &regs) == 0);
+	csr_write(CSR_HGATP, hgatp);
+	TEST_ASSERT(sm_set_run_page(0, pfns[0] << PAGE_SHIFT) == 0);
+	struct vcpu_state *state = get_vcpu_state(TEST_VMID, 0);
+	TEST_ASSERT(state && atomic_read(&state->run_page) ==
+				     (long)(pfns[0] << PAGE_SHIFT));
+
+	unsigned long tlbs = host_tlb_requests;
+	TEST_ASSERT(sm_set_private_memory(TEST_GPA, 8 * PAGE_SIZE) == 0);
+	TEST_ASSERT(host_tlb_requests == tlbs + 1);
+	TEST_ASSERT(!entry_valid(hpt_entry(&hpt, 0, 0x1000, HPT_4K, false)));
+	TEST_ASSERT(!entry_valid(hpt_entry(&hpt, 0, 0x2000, HPT_4K, false)));
+	TEST_ASSERT(entry_valid(hpt_entry(&hpt, 0, 0x3000, HPT_4K, false)));
+	TEST_ASSERT(atomic_read(&state->run_page) == 0);
+
+	TEST_ASSERT(contain_private_range(pfns[0], 1) == 1);
+	TEST_ASSERT(contain_private_range(pfns[1] + 7, 1) == 1);
+	TEST_ASSERT(test_public_shared_range(pfns[0] + 4, pfns[1] - pfns[0]) == 1);
+
+	// private pages can neither be mapped nor become run pages
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x4000, pfns[0] + 2, HPT_4K) < 0);
+	TEST_ASSERT(sm_set_run_page(0, (pfns[0] + 2) << PAGE_SHIFT) < 0);
+
+	// nor can SM memory become guest memory
+	const uint64_t sm_pfns[2] = { (uintptr_t)hpt.bitmap >> PAGE_SHIFT,
+				      (uintptr_t)hpt.bitmap >> PAGE_SHIFT };
+	csr_write(CSR_HGATP, guest_hgatp(TEST_VMID, sm_pfns));
+	TEST_ASSERT(sm_set_private_memory(TEST_GPA, PAGE_SIZE) < 0);
+
+	// and a region with SM memory after DRAM converts nothing
+	const uint64_t mixed_pfns[2] = { HPT_DRAM_PFN(128), sm_pfns[0] };
+	TEST_ASSERT(hpt_map(&hpt, 0, 0x5000, mixed_pfns[0] + 1, HPT_4K) == 0);
+	csr_write(CSR_HGATP, guest_hgatp(TEST_VMID, mixed_pfns));
+	TEST_ASSERT(sm_set_private_memory(TEST_GPA, 8 * PAGE_SIZE) < 0);
+	TEST_ASSERT(contain_private_range(mixed_pfns[0], 4) == 0);
+	TEST_ASSERT(entry_valid(hpt_entry(&hpt, 0, 0x5000, HPT_4K, false)));
+
+	TEST_ASSERT(sm_destroy_vm(TEST_VMID) == 0);
+}
+
+static void test_vcpu_registry(void)
+{
+	struct sbi_trap_regs regs = { 0 };
+
+	for (int round = 0; round < 200; round++) {
+		for (unsigned long vm = 1; vm <= 32; vm++) {
+			for (uint64_t cpu = 0; cpu < 8; cpu++) {
+				csr_write(CSR_HGATP, vm << HGATP_VMID_SHIFT);
+				TEST_ASSERT(sm_create_cpu(cpu + round, &regs) == 0);
+			}
+		}
+		// every arena is taken
+		csr_write(CSR_HGATP, 33UL << HGATP_VMID_SHIFT);
+		TEST_ASSERT(sm_create_cpu(0, &regs) != 0);
+
+		for (unsigned long vm = 1; vm <= 32; vm++) {
+			struct vcpu_state *state = get_vcpu_state(vm, round + 3);
+			TEST_ASSERT(state && state->vm_id == vm);
+			TEST_ASSERT(!get_vcpu_state(vm, round + 8));
+			TEST_ASSERT(sm_destroy_vm(vm) == 0);
+			TEST_ASSERT(!get_vcpu_state(vm, round + 3));
+		}
+	}
+}
+
+static void test_mmio_windows(void)
+{
+	csr_write(CSR_HGATP, (unsigned long)TEST_VMID << HGATP_VMID_SHIFT);
+	for (int i = 7; i > 0; i--)
+		TEST_ASSERT(sm_register_mmio(0x10000000 + i * 0x2000, 0x1000) == 0);
+	TEST_ASSERT(sm_register_mmio(0x10002800, 0x1000) < 0);
+	TEST_ASSERT(sm_register_mmio(0x10001800, 0x1000) < 0);
+	TEST_ASSERT(sm_register_mmio(0x10000000, 0x1000) == 0);
+	TEST_ASSERT(sm_register_mmio(0x20000000, 0x1000) < 0);
+	TEST_ASSERT(sm_destroy_vm(TEST_VMID) == 0);
+	TEST_ASSERT(sm_register_mmio(0x20000000, 0x1000) == 0);
+	TEST_ASSERT(sm_register_mmio(0x10000000, 0) < 0);
+	TEST_ASSERT(sm_destroy_vm(TEST_VMID) == 0);
+}
+
+static void test_world_switch(void)
+{
+	struct sbi_trap_regs regs = { .s0 = 0x5a5a };
+	struct sbi_trap_info trap = { .cause = CAUSE_VIRTUAL_SUPERVISOR_ECALL };
+	unsigned long host_mideleg = csr_read(CSR_MIDELEG);
+
+	ws_vm_create(TEST_VMID);
+	ws_vcpu_create(TEST_VMID, 0, &regs);
+	TEST_ASSERT(regs.s0 == 0x5a5a);
+
+	// the guest runs with the S interrupts kept in M mode
+	TEST_ASSERT(sm_resume_cpu(0, &regs) == 0);
+	TEST_ASSERT(regs.s0 == 0x5a5a);
+	TEST_ASSERT(csr_read(CSR_MIDELEG) ==
+		    (host_mideleg & ~(MIP_SSIP | MIP_STIP | MIP_SEIP)));
+	TEST_ASSERT(csr_read(CSR_HGATP) >> HGATP_MODE_SHIFT == HGATP_MODE_SV39X4);
+
+	// an SBI call only shows a0-a7 to the host
+	regs.a0 = 1;
+	regs.a7 = SBI_EXT_TIME;
+	TEST_ASSERT(sm_preserve_cpu(&regs, &trap) == 0);
+	TEST_ASSERT(regs.s0 == 0 && regs.a0 == 1 && regs.a7 == SBI_EXT_TIME);
+	TEST_ASSERT(csr_read(CSR_MIDELEG) == host_mideleg);
+	TEST_ASSERT(csr_read(CSR_HGATP) ==
+		    (unsigned long)TEST_VMID << HGATP_VMID_SHIFT);
+
+	// the host answers in a0, the guest gets the rest back
+	regs.a0 = 0;
+	regs.s1 = 99;
+	TEST_ASSERT(sm_resume_cpu(0, &regs) == 0);
+	TEST_ASSERT(regs.a0 == 0 && regs.s0 == 0x5a5a && regs.s1 == 0);
+	trap.cause = IRQ_S_TIMER_FLIPPED;
+	TEST_ASSERT(sm_preserve_cpu(&regs, &trap) == 0);
+	TEST_ASSERT(sm_preserve_cpu(&regs, &trap) != 0);
+
+	// an interrupted guest only resumes where it was interrupted
+	host_csr_poke(CSR_SEPC, WS_GUEST_PC + 4);
+	TEST_ASSERT(sm_resume_cpu(0, &regs) != 0);
+	host_csr_poke(CSR_SEPC, WS_GUEST_PC);
+
+	// the shadowed delegation: mideleg and hgatp written once each way
+	for (int cause = 0; cause < WS_CAUSES; cause++) {
+		TEST_ASSERT(ws_round_trip(TEST_VMID, 0, cause, &regs) == 0);
+		unsigned long writes = host_csr_writes;
+		TEST_ASSERT(ws_round_trip(TEST_VMID, 0, cause, &regs) == 0);
+		TEST_ASSERT(host_csr_writes - writes == 4);
+		TEST_ASSERT(csr_read(CSR_MIDELEG) == host_mideleg);
+	}
+
+	TEST_ASSERT(sm_destroy_vm(TEST_VMID) == 0);
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(void);
+} tests[] = {
+	{ "bitmap_random", test_bitmap_random },
+	{ "bitmap_counters", test_bitmap_counters },
+	{ "bitmap_bounds", test_bitmap_bounds },
+	{ "set_pte_single", test_set_pte_single },
+	{ "set_pte_rejects", test_set_pte_rejects },
+	{ "set_pte_memcpy", test_set_pte_memcpy },
+	{ "set_pte_clear", test_set_pte_clear },
+	{ "set_pte_batch", test_set_pte_batch },
+	{ "unmap_huge", test_unmap_huge },
+	{ "unmap_batch", test_unmap_batch },
+	{ "monitor_init", test_monitor_init },
+	{ "private_memory", test_private_memory },
+	{ "vcpu_registry", test_vcpu_registry },
+	{ "mmio_windows", test_mmio_windows },
+	{ "world_switch", test_world_switch },
+};
+
+int main(void)
+{
+	host_init();
+	hpt_area_alloc(&hpt, 2, 16, 64, TEST_DRAM_PAGES);
+
+	for (int i = 0; i < array_size(tests); i++) {
+		tests[i].fn();
+		host_printf("ok %d - %s\n", i + 1, tests[i].name);
+	}
+	host_printf("1..%d\n", (int)array_size(tests));
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Round trips through the SM world switch for the host build.
+ */
+
+#include "host.h"
+#include "world_switch.h"
+#include <sbi/riscv_asm.h>
+#include <sbi/riscv_encoding.h>
+#include <sm/sm.h>
+
+// wfi, and lw a0, 0(a0) as mtinst reports it
+#define WS_INSN_WFI 0x10500073UL
+#define WS_TINST_LW 0x00052503UL
+
+static const struct sbi_trap_info ws_traps[WS_CAUSES] = {
+	[WS_ECALL]	  = { .cause = CAUSE_VIRTUAL_SUPERVISOR_ECALL },
+	[WS_VIRTUAL_INST] = { .cause = CAUSE_VIRTUAL_INST_FAULT,
+			      .tval  = WS_INSN_WFI },
+	[WS_MMIO_LOAD]	  = { .cause = CAUSE_LOAD_GUEST_PAGE_FAULT,
+			      .tval  = WS_MMIO_GPA & 0x3,
+			      .tval2 = WS_MMIO_GPA >> 2,
+			      .tinst = WS_TINST_LW },
+	[WS_INTERRUPT]	  = { .cause = IRQ_S_TIMER_FLIPPED },
+};
+
+static void ws_set_vm(unsigned long vm_id)
+{
+	csr_write(CSR_HGATP, ((uintptr_t)HGATP_MODE_SV39X4 << HGATP64_MODE_SHIFT) |
+				     (vm_id << HGATP_VMID_SHIFT));
+}
+
+void ws_vm_create(unsigned long vm_id)
+{
+	ws_set_vm(vm_id);
+	TEST_ASSERT(sm_register_mmio(WS_MMIO_GPA, PAGE_SIZE) == 0);
+}
+
+void ws_vcpu_create(unsigned long vm_id, uint64_t cpu_id,
+		    struct sbi_trap_regs *regs)
+{
+	regs->mepc = WS_GUEST_PC;
+	ws_set_vm(vm_id);
+	TEST_ASSERT(sm_create_cpu(cpu_id, regs) == 0);
+}
+
+int ws_round_trip(unsigned long vm_id, uint64_t cpu_id, int cause,
+		  struct sbi_trap_regs *regs)
+{
+	struct sbi_trap_info trap = ws_traps[cause];
+	int ret;
+
+	// the host returns to the guest: past the instruction, or to the
+	// interrupted one
+	if (cause == WS_VIRTUAL_INST)
+		host_csr_poke(CSR_SEPC, WS_GUEST_PC + 4);
+	else if (cause == WS_INTERRUPT)
+		host_csr_poke(CSR_SEPC, WS_GUEST_PC);
+	host_csr_poke(CSR_HGATP, vm_id << HGATP_VMID_SHIFT);
+
+	ret = sm_resume_cpu(cpu_id, regs);
+	if (ret)
+		return ret;
+
+	trap.epc   = regs->mepc;
+	regs->mepc = WS_GUEST_PC;
+	return sm_preserve_cpu(regs, &trap);
+}
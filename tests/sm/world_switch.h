@@ -0,0 +1,49 @@
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Round trips through the SM world switch for the host build: the host
+ * enters a vCPU with sm_resume_cpu and the trap handler leaves it with
+ * sm_preserve_cpu, for a given exit cause.
+ */
+
+#ifndef __SM_HOST_WORLD_SWITCH_H__
+#define __SM_HOST_WORLD_SWITCH_H__
+
+#include <sbi/sbi_types.h>
+#include <sbi/sbi_trap.h>
+
+/** Exit causes of ws_round_trip */
+#define WS_ECALL 0
+#define WS_VIRTUAL_INST 1
+#define WS_MMIO_LOAD 2
+#define WS_INTERRUPT 3
+#define WS_CAUSES 4
+
+/** pc of the guest, constant across round trips */
+#define WS_GUEST_PC 0x80200000UL
+
+/** MMIO window of every VM, WS_MMIO_LOAD exits load from it */
+#define WS_MMIO_GPA 0x10000000UL
+
+/** Register the MMIO window of a VM */
+void ws_vm_create(unsigned long vm_id);
+
+/**
+ * Create a vCPU of a VM, on the calling hart
+ *
+ * @param regs the initial registers of the guest, mepc is set to WS_GUEST_PC
+ */
+void ws_vcpu_create(unsigned long vm_id, uint64_t cpu_id,
+		    struct sbi_trap_regs *regs);
+
+/**
+ * Enter the vCPU and exit it for the cause, on the calling hart. The host
+ * emulation of the previous exit is that of the same cause.
+ *
+ * @param regs the trap frame, the host's view of the vCPU
+ * @return 0 on success, the failing call's error code otherwise
+ */
+int ws_round_trip(unsigned long vm_id, uint64_t cpu_id, int cause,
+		  struct sbi_trap_regs *regs);
+
+#endif